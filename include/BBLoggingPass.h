@@ -7,15 +7,53 @@
 
 namespace ppa {
 
+// With paths set, the pass also numbers the acyclic paths of every function
+// as Ball and Larus do, so that a run whose runtime traces paths (see
+// TraceFormat.h) writes one record per path instead of one per block exit.
+// A path ends at a back edge and at an edge into a block that calls
+// anything: the block then exits after the blocks of its callee, so it
+// starts a path of its own and the paths spell out the same post-order as
+// the exits would. Functions whose control flow is not all branches,
+// switches and returns, or that have too many paths, exit block by block.
+//
+// The numbering is emitted as SEBB_RUNTIME_numPathWords words at
+// SEBB_RUNTIME_paths. For every function they are the number of its first
+// path, its number of blocks n, their ids, its number of edges, and then
+// every edge as its source, its target and its increment. Node 0 is where
+// every path starts, nodes 1 to n are the blocks and node n + 1 is where
+// every path ends.
 struct BBLoggingPass : public llvm::ModulePass {
   static char ID;
+  // Bumped whenever the instrumentation changes, as cached binaries built by
+  // an older version are stale.
+  static constexpr unsigned Version = 3;
 
-  BBLoggingPass(llvm::DenseMap<uint64_t, llvm::BasicBlock*>& idMap)
-      : llvm::ModulePass(ID), idMap_(idMap) {}
+  BBLoggingPass(llvm::DenseMap<uint64_t, llvm::BasicBlock*>& idMap,
+                bool paths = false)
+      : llvm::ModulePass(ID), idMap_(idMap), paths_(paths) {}
 
   bool runOnModule(llvm::Module& m) override;
+  // Reports how many hooks were inserted and how many events were not given
+  // one of their own.
+  void print(llvm::raw_ostream& os, const llvm::Module* m) const override;
+
+  uint64_t numRemovedHooks() const {
+    return numBlocks_ + numConstants_ + numMerged_;
+  }
 
   llvm::DenseMap<uint64_t, llvm::BasicBlock*>& idMap_;
+  bool paths_;
+  uint64_t numHooks_ = 0;
+  // Blocks instrumented, which no longer get an enter hook.
+  uint64_t numBlocks_ = 0;
+  // Values logged through the constant table instead of a hook.
+  uint64_t numConstants_ = 0;
+  // Values logged as both an input and an output by a single hook.
+  uint64_t numMerged_ = 0;
+  // Functions traced by paths, and those that could have been but exit
+  // block by block.
+  uint64_t numPathFunctions_ = 0;
+  uint64_t numBlockFunctions_ = 0;
 };
 
 } // namespace ppa
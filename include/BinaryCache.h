@@ -0,0 +1,39 @@
+#ifndef PPADETECTOR_BINARYCACHE_H
+#define PPADETECTOR_BINARYCACHE_H
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+
+namespace ppa {
+
+// A directory of instrumented executables, named after a hash of everything
+// that goes into them, so that a program is instrumented and compiled once
+// however often it is compared. Several detector processes may share it:
+// entries are written to a temporary file and renamed into place, and are
+// evicted, least recently used first, once the cache outgrows its limit.
+class BinaryCache {
+public:
+  BinaryCache(llvm::StringRef directory, uint64_t sizeLimit);
+
+  // The key of the executable built from m, before instrumentation, with the
+  // instrumentation and build described by buildKey.
+  static std::string computeKey(const llvm::Module& m,
+                                llvm::StringRef buildKey);
+
+  // Puts the executable cached under key at exePath. Returns false on a miss.
+  bool fetch(llvm::StringRef key, llvm::StringRef exePath);
+  // Caches the executable at exePath under key.
+  void store(llvm::StringRef key, llvm::StringRef exePath);
+
+private:
+  std::string getEntryPath(llvm::StringRef key) const;
+
+  std::string directory_;
+  uint64_t sizeLimit_;
+};
+
+} // namespace ppa
+
+#endif
@@ -4,12 +4,23 @@
 #include "llvm/ADT/StringRef.h"
 #include "llvm/IR/Module.h"
 
+#include <string>
+
 namespace ppa {
 
 class Compiler {
 public:
-  Compiler(); 
+  // Builds at optLevel (0 to 3). Above 0 the runtime is linked into the
+  // programs as bitcode, if it was built, and inlined.
+  explicit Compiler(unsigned optLevel = 0);
   void Compile(llvm::Module& module, llvm::StringRef outFile);
+  // Identifies everything besides the module that goes into the executables:
+  // the code generation flags and the libraries they are linked against.
+  std::string GetBuildKey();
+
+private:
+  unsigned optLevel_;
+  std::string buildKey_;
 };
 
 } // namespace ppa
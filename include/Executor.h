@@ -0,0 +1,32 @@
+#ifndef PPADETECTOR_EXECUTOR_H
+#define PPADETECTOR_EXECUTOR_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Module.h"
+
+#include <string>
+
+namespace ppa {
+
+// Turns instrumented modules into programs and runs them on test cases.
+class Executor {
+public:
+  virtual ~Executor() = default;
+  // Builds the instrumented module m into the program called name.
+  virtual void Build(llvm::Module& m, llvm::StringRef name) = 0;
+  // If programs are executables at the path they are named after, which can
+  // be cached, identifies everything besides the module that goes into them.
+  // Empty otherwise.
+  virtual std::string GetBuildKey() { return ""; }
+  // Runs a program with its standard input read from inputPath, its output
+  // discarded and env as its environment, and waits for it to exit. Returns
+  // its exit status, or a negative value if it did not exit normally. May be
+  // called from several threads at once.
+  virtual int Run(llvm::StringRef name, llvm::StringRef inputPath,
+                  llvm::ArrayRef<llvm::StringRef> env) = 0;
+};
+
+} // namespace ppa
+
+#endif
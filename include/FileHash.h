@@ -0,0 +1,16 @@
+#ifndef PPADETECTOR_FILEHASH_H
+#define PPADETECTOR_FILEHASH_H
+
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+
+namespace ppa {
+
+// Hex SHA1 of the contents of a file, or the empty string if it is
+// unreadable. Keys the trace store and the instruction histogram index.
+std::string hashFile(llvm::StringRef path);
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,31 @@
+#ifndef PPADETECTOR_FORKSERVER_H
+#define PPADETECTOR_FORKSERVER_H
+
+#include <cstdint>
+
+// Protocol between the detector and an instrumented program running as a
+// fork server. Like TraceFormat.h it is shared with the runtime, so it only
+// depends on the C++ library.
+//
+// The detector starts the program with kForkServerEnvVar set, reading
+// requests from kForkServerControlFd and writing replies to
+// kForkServerStatusFd. The runtime stops before main, writes a uint32_t 0 to
+// say hello, and then serves requests until the control pipe is closed:
+//
+//   request  a uint32_t size, then that many bytes: the path of the test
+//            case and the environment of the run, each NUL-terminated
+//   reply    an int32_t, the status of the child from waitpid or -1 if it
+//            could not be forked
+//
+// For every request the server forks a child, which reads the test case on
+// its standard input, takes on the environment and goes on into main.
+
+namespace ppa {
+
+constexpr const char* kForkServerEnvVar = "PPA_DETECTOR_FORK_SERVER";
+constexpr int kForkServerControlFd = 198;
+constexpr int kForkServerStatusFd = 199;
+
+} // namespace ppa
+
+#endif
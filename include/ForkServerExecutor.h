@@ -0,0 +1,39 @@
+#ifndef PPADETECTOR_FORKSERVEREXECUTOR_H
+#define PPADETECTOR_FORKSERVEREXECUTOR_H
+
+#include "NativeExecutor.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <memory>
+#include <mutex>
+#include <vector>
+
+namespace ppa {
+
+// Builds executables like NativeExecutor, but starts each of them once as a
+// fork server (see ForkServer.h) and has it fork a child per test case, which
+// saves the exec, dynamic loading and startup of every run. Programs that do
+// not answer as fork servers are run natively.
+class ForkServerExecutor : public NativeExecutor {
+public:
+  explicit ForkServerExecutor(unsigned optLevel = 0);
+  ~ForkServerExecutor() override;
+  int Run(llvm::StringRef name, llvm::StringRef inputPath,
+          llvm::ArrayRef<llvm::StringRef> env) override;
+
+private:
+  struct Server;
+
+  std::unique_ptr<Server> startServer(llvm::StringRef name,
+                                      llvm::ArrayRef<llvm::StringRef> env);
+
+  // Servers are started as needed, so there are as many per program as runs
+  // of it went in parallel; idle ones wait here.
+  std::mutex mutex_;
+  llvm::StringMap<std::vector<std::unique_ptr<Server>>> idle_;
+  llvm::StringMap<bool> unsupported_;
+};
+
+} // namespace ppa
+
+#endif
@@ -1,26 +1,69 @@
 #ifndef PPADETECTOR_INSTHISTCOMPARATOR_H
 #define PPADETECTOR_INSTHISTCOMPARATOR_H
 
-#include "Comparator.h"
 #include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/IR/Instruction.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/Support/Error.h"
+
+#include <utility>
+#include <vector>
 
 namespace ppa {
 
 using InstHistogram = llvm::DenseMap<unsigned int, double>;
 
-struct InstHistPass : public llvm::ModulePass {
-  static char ID;
-  InstHistogram* histogram;
-  InstHistPass(InstHistogram* histogram)
-      : llvm::ModulePass(ID), histogram(histogram) {}
-  bool runOnModule(llvm::Module& m) override;
-  void handleInstruction(llvm::Instruction* i);
+// LLVM opcodes are a small dense range, so a histogram fits in a fixed array
+// of frequencies indexed by opcode, padded to a whole number of SIMD lanes.
+constexpr size_t kInstHistLanes = 16;
+constexpr size_t kInstHistWidth =
+    (llvm::Instruction::OtherOpsEnd + kInstHistLanes - 1) / kInstHistLanes *
+    kInstHistLanes;
+
+// An instruction histogram normalized to frequencies summing to 1, or all
+// zero for a module without instructions.
+struct alignas(64) DenseInstHistogram {
+  float frequencies[kInstHistWidth] = {};
 };
 
-class InstHistComparator : public Comparator<InstHistPass, InstHistPass> {
+DenseInstHistogram densifyHistogram(const InstHistogram& histogram);
+
+// The histogram of the module in the IR file at path. Bitcode is read lazily:
+// functions are materialized one at a time and their bodies dropped once
+// counted, so memory does not grow with the number of functions. Threads may
+// call this concurrently as long as each has its own context.
+llvm::Expected<InstHistogram> computeHistogram(llvm::StringRef path,
+                                               llvm::LLVMContext& context);
+
+// 1 minus the chi-square distance of two normalized histograms.
+float compareDenseHistograms(const DenseInstHistogram& p,
+                             const DenseInstHistogram& s);
+
+// The histograms of many modules, stored densely so that one histogram can be
+// compared against all of them in a single pass.
+class InstHistBatch {
 public:
-  void compareModules(llvm::Module& p, llvm::Module& s) override;
-  ~InstHistComparator() = default;
+  // Adds histogram and returns its index.
+  size_t add(const InstHistogram& histogram);
+  size_t add(const DenseInstHistogram& histogram);
+  size_t size() const { return histograms_.size(); }
+  const DenseInstHistogram& operator[](size_t i) const {
+    return histograms_[i];
+  }
+
+  // The similarity of query to every stored histogram, by index.
+  std::vector<float> computeSimilarities(const DenseInstHistogram& query) const;
+  // The k stored histograms most similar to query, as (index, similarity),
+  // most similar first; ties go to the lower index.
+  std::vector<std::pair<size_t, float>>
+  findMostSimilar(const DenseInstHistogram& query, size_t k) const;
+  // The similarity of every pair of stored histograms, row-major, on up to
+  // numJobs threads (0: one per hardware thread).
+  std::vector<float> computeMatrix(unsigned numJobs = 1) const;
+
+private:
+  std::vector<DenseInstHistogram> histograms_;
 };
 
 } // namespace ppa
@@ -0,0 +1,82 @@
+#ifndef PPADETECTOR_INSTHISTINDEX_H
+#define PPADETECTOR_INSTHISTINDEX_H
+
+#include "InstHistComparator.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace ppa {
+
+// The instruction histogram of every submission ever analyzed, keyed by a
+// hash of its bitcode and kept in one file, so that a submission is parsed
+// once and a new one can be checked against all earlier ones without loading
+// them. Records are appended to the file as submissions come in; several
+// detector processes may share it.
+//
+// Nearest neighbors are searched in a vantage point tree under the Hellinger
+// distance, which unlike chi-square is a metric, and the candidates found are
+// ranked by chi-square similarity like InstHistBatch does.
+class InstHistIndex {
+public:
+  // Opens the index at path, creating it if it does not exist.
+  explicit InstHistIndex(llvm::StringRef path);
+
+  size_t size() const { return entries_.size(); }
+  llvm::StringRef key(size_t i) const { return entries_[i].key; }
+  llvm::StringRef name(size_t i) const { return entries_[i].name; }
+
+  // The histogram stored under key, or null on a miss.
+  const DenseInstHistogram* lookup(llvm::StringRef key) const;
+  // Adds the histogram of a submission, named for reports, unless the index
+  // already has key.
+  void insert(llvm::StringRef key, llvm::StringRef name,
+              const DenseInstHistogram& histogram);
+
+  // About the k entries most similar to query, as (index, similarity), most
+  // similar first. Chi-square and Hellinger rank close histograms alike, but
+  // not always in the same order, hence the approximation.
+  std::vector<std::pair<size_t, float>>
+  findNearest(const DenseInstHistogram& query, size_t k) const;
+
+private:
+  struct Entry {
+    std::string key;
+    std::string name;
+    DenseInstHistogram histogram;
+    // Square roots of the frequencies: the Hellinger distance of two
+    // histograms is the Euclidean one of their roots over sqrt(2).
+    DenseInstHistogram roots;
+  };
+
+  // Entry vantage; the entries within radius of it are under inside, the
+  // others under outside. Children are node indices, or -1 for none.
+  struct Node {
+    uint32_t vantage;
+    float radius;
+    int32_t inside;
+    int32_t outside;
+  };
+
+  void create();
+  void load();
+  void add(Entry entry);
+  int32_t build(std::vector<std::pair<float, uint32_t>>& points, size_t begin,
+                size_t end);
+  void rebuild();
+
+  std::string path_;
+  std::vector<Entry> entries_;
+  llvm::StringMap<size_t> byKey_;
+  std::vector<Node> nodes_;
+  int32_t root_ = -1;
+  // Entries added since the tree was built, searched one by one.
+  std::vector<uint32_t> pending_;
+};
+
+} // namespace ppa
+
+#endif
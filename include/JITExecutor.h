@@ -0,0 +1,46 @@
+#ifndef PPADETECTOR_JITEXECUTOR_H
+#define PPADETECTOR_JITEXECUTOR_H
+
+#include "Executor.h"
+#include "llvm/ADT/StringMap.h"
+
+#include <memory>
+
+namespace llvm {
+namespace orc {
+class LLJIT;
+}
+} // namespace llvm
+
+namespace ppa {
+
+// Compiles programs in memory with ORC, binding them to the SEBB runtime
+// linked into the detector, and runs each test case in a forked child. No
+// object files, linker or executables are involved.
+class JITExecutor : public Executor {
+public:
+  JITExecutor();
+  ~JITExecutor() override;
+  void Build(llvm::Module& m, llvm::StringRef name) override;
+  int Run(llvm::StringRef name, llvm::StringRef inputPath,
+          llvm::ArrayRef<llvm::StringRef> env) override;
+
+  struct Program {
+    std::unique_ptr<llvm::orc::LLJIT> jit;
+    int (*main)(int, char**) = nullptr;
+    void (*constructors)() = nullptr;
+    void (*destructors)() = nullptr;
+    uint64_t numBBs = 0;
+    const uint64_t* constants = nullptr;
+    uint64_t numConstants = 0;
+    const uint64_t* paths = nullptr;
+    uint64_t numPathWords = 0;
+  };
+
+private:
+  llvm::StringMap<Program> programs_;
+};
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,65 @@
+#ifndef PPADETECTOR_LCS_H
+#define PPADETECTOR_LCS_H
+
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/STLExtras.h"
+
+#include <cstdint>
+
+namespace ppa {
+
+// Whether plaintiff basic block p and suspicious basic block s match.
+using BBRelation = llvm::function_ref<bool(uint64_t p, uint64_t s)>;
+
+// Length of the longest common subsequence of the control flow traces p and
+// s, where p[j] and s[i] match iff related(p[j], s[i]). The relation need not
+// be an equivalence. Long traces are compared with up to numJobs threads (0:
+// one per hardware thread).
+size_t computeLCS(llvm::ArrayRef<uint64_t> p, llvm::ArrayRef<uint64_t> s,
+                  BBRelation related, unsigned numJobs = 1);
+
+// Bounds on the length of an LCS, equal once it is known exactly.
+struct LCSBounds {
+  size_t lower = 0;
+  size_t upper = 0;
+
+  bool exact() const { return lower == upper; }
+};
+
+// Like computeLCS, for when all that matters is whether the LCS reaches
+// target. Bounds from the lengths and symbol counts of the traces come first,
+// then a DP restricted to the diagonals that a common subsequence of target
+// positions can use, which stops as soon as the LCS is known to reach target
+// or to fall short of it. Only when neither is known before the end is the
+// result exact. A target of 0 computes the LCS exactly.
+LCSBounds computeLCSBounded(llvm::ArrayRef<uint64_t> p,
+                            llvm::ArrayRef<uint64_t> s, BBRelation related,
+                            size_t target, unsigned numJobs = 1);
+
+// Reference O(|p||s|) dynamic programming, which lcs-bench --verify checks the
+// other kernels against.
+size_t computeLCSNaive(llvm::ArrayRef<uint64_t> p, llvm::ArrayRef<uint64_t> s,
+                       BBRelation related);
+
+// Bit-parallel LCS (Allison-Dix / Hyyro): one bit per column of a DP row and
+// 64 columns per word operation.
+size_t computeLCSBitParallel(llvm::ArrayRef<uint64_t> p,
+                             llvm::ArrayRef<uint64_t> s, BBRelation related);
+
+// Bit-parallel LCS of both traces shortened without changing the result:
+// positions that match nothing in the other trace are dropped, and a loop, a
+// body repeated back to back, is cut down to as many copies as a common
+// subsequence can use.
+size_t computeLCSCompressed(llvm::ArrayRef<uint64_t> p,
+                            llvm::ArrayRef<uint64_t> s, BBRelation related,
+                            unsigned numJobs = 1);
+
+// Bit-parallel LCS with the DP split into tiles, whose anti-diagonals run on
+// up to numJobs threads (0: one per hardware thread).
+size_t computeLCSWavefront(llvm::ArrayRef<uint64_t> p,
+                           llvm::ArrayRef<uint64_t> s, BBRelation related,
+                           unsigned numJobs);
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,25 @@
+#ifndef PPADETECTOR_NATIVEEXECUTOR_H
+#define PPADETECTOR_NATIVEEXECUTOR_H
+
+#include "Compiler.h"
+#include "Executor.h"
+
+namespace ppa {
+
+// Compiles and links programs into executables at the path they are named
+// after, and runs them as child processes.
+class NativeExecutor : public Executor {
+public:
+  explicit NativeExecutor(unsigned optLevel = 0) : compiler_(optLevel) {}
+  void Build(llvm::Module& m, llvm::StringRef name) override;
+  std::string GetBuildKey() override { return compiler_.GetBuildKey(); }
+  int Run(llvm::StringRef name, llvm::StringRef inputPath,
+          llvm::ArrayRef<llvm::StringRef> env) override;
+
+private:
+  Compiler compiler_;
+};
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,55 @@
+#ifndef PPADETECTOR_PARALLEL_H
+#define PPADETECTOR_PARALLEL_H
+
+#include <algorithm>
+#include <atomic>
+#include <thread>
+#include <vector>
+
+namespace ppa {
+
+// Number of worker threads to use for a requested job count; 0 means one per
+// hardware thread.
+inline unsigned resolveNumJobs(unsigned numJobs) {
+  if (numJobs == 0) {
+    numJobs = std::thread::hardware_concurrency();
+  }
+  return std::max(numJobs, 1u);
+}
+
+// Calls fn(i) for every i in [begin, end) using at most numJobs threads.
+// Indices are handed out one at a time, so uneven work items balance out.
+template <typename Fn>
+void parallelFor(unsigned numJobs, size_t begin, size_t end, Fn fn) {
+  if (begin >= end) {
+    return;
+  }
+  size_t numThreads = std::min<size_t>(resolveNumJobs(numJobs), end - begin);
+  if (numThreads == 1) {
+    for (size_t i = begin; i < end; i++) {
+      fn(i);
+    }
+    return;
+  }
+
+  std::atomic<size_t> next{begin};
+  auto worker = [&]() {
+    for (size_t i = next++; i < end; i = next++) {
+      fn(i);
+    }
+  };
+
+  std::vector<std::thread> threads;
+  threads.reserve(numThreads - 1);
+  for (size_t t = 1; t < numThreads; t++) {
+    threads.emplace_back(worker);
+  }
+  worker();
+  for (auto& thread : threads) {
+    thread.join();
+  }
+}
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,126 @@
+#ifndef PPADETECTOR_RUNLOG_H
+#define PPADETECTOR_RUNLOG_H
+
+#include "TraceFormat.h"
+#include "llvm/ADT/ArrayRef.h"
+
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+namespace ppa {
+
+// One execution of a basic block: its inputs followed by its outputs, both
+// sorted, at values[begin, begin + numInputs + numOutputs). If the values were
+// sketched instead, its input and output sketches are at sketches[begin] and
+// sketches[begin + 1]. Executions of a block with the same values are kept
+// once, and when the runtime samples executions, a logged one also stands for
+// the executions of the block that were skipped after it, so an execution
+// counts as count executions.
+struct BBExecution {
+  uint64_t begin;
+  uint32_t numInputs;
+  uint32_t numOutputs;
+  uint64_t count;
+};
+
+// Everything the basic blocks of a program logged during one run, decoded
+// into a few flat arrays (CSR style): one array of values, one of
+// executions grouped by basic block, and per-block offsets into the latter.
+// The arrays are shared by copies and may live in a mapped trace store entry
+// (see TraceStore.h).
+class RunLog {
+public:
+  // Decodes a trace written by the SEBB runtime (see TraceFormat.h). An empty
+  // trace, from a run that never started logging, decodes to an empty log.
+  static RunLog decode(llvm::ArrayRef<uint8_t> trace);
+
+  // Ids of the basic blocks that ran, in ascending order.
+  llvm::ArrayRef<uint64_t> blocks() const { return blocks_; }
+  uint64_t maxBBID() const { return blocks_.empty() ? 0 : blocks_.back(); }
+
+  llvm::ArrayRef<BBExecution> executions(uint64_t id) const {
+    if (id + 1 >= offsets_.size()) {
+      return {};
+    }
+    return llvm::makeArrayRef(executions_.data() + offsets_[id],
+                              executions_.data() + offsets_[id + 1]);
+  }
+
+  // Whether the runtime sketched the values instead of logging them, in which
+  // case only the sketches are available.
+  bool sketched() const { return sketched_; }
+
+  const ValueSketch& inputSketch(const BBExecution& execution) const {
+    return sketches_[execution.begin];
+  }
+
+  const ValueSketch& outputSketch(const BBExecution& execution) const {
+    return sketches_[execution.begin + 1];
+  }
+
+  llvm::ArrayRef<uint64_t> inputs(const BBExecution& execution) const {
+    return llvm::makeArrayRef(values_.data() + execution.begin,
+                              execution.numInputs);
+  }
+
+  llvm::ArrayRef<uint64_t> outputs(const BBExecution& execution) const {
+    return llvm::makeArrayRef(values_.data() + execution.begin +
+                                  execution.numInputs,
+                              execution.numOutputs);
+  }
+
+private:
+  friend class TraceStore;
+
+  bool sketched_ = false;
+  llvm::ArrayRef<uint64_t> values_;
+  llvm::ArrayRef<ValueSketch> sketches_;
+  llvm::ArrayRef<BBExecution> executions_;
+  // Executions of block id are executions_[offsets_[id], offsets_[id + 1]).
+  llvm::ArrayRef<uint64_t> offsets_;
+  llvm::ArrayRef<uint64_t> blocks_;
+  // What the arrays point into.
+  std::shared_ptr<const void> storage_;
+};
+
+// The ids of the basic blocks of a run in the order they exited, kept as
+// runs: stretches of a pool of ids, each repeated some number of times. A
+// Ball-Larus path (see BBLoggingPass.h) has its blocks in the pool once, and
+// each time it is taken, or taken again back to back, costs a run rather than
+// its blocks, so a trace by paths stays about as small in memory and in the
+// trace store as it was in the file. The ids are only expanded for the LCS.
+class ControlFlowTraceLog {
+public:
+  // ids[first, first + length) of the pool, count times over.
+  struct Run {
+    uint64_t first;
+    uint64_t length;
+    uint64_t count;
+  };
+
+  static ControlFlowTraceLog decode(llvm::ArrayRef<uint8_t> trace);
+
+  // Number of blocks in the trace.
+  size_t size() const { return size_; }
+  // Every id in the trace at least once, in no particular order.
+  llvm::ArrayRef<uint64_t> pool() const { return pool_; }
+  // The ids in order: the pool itself when it is the whole trace, else
+  // expanded into scratch.
+  llvm::ArrayRef<uint64_t> ids(std::vector<uint64_t>& scratch) const;
+
+private:
+  friend class TraceStore;
+
+  // Sets size_ from runs_; false if a run is out of the pool.
+  bool computeSize();
+
+  llvm::ArrayRef<uint64_t> pool_;
+  llvm::ArrayRef<Run> runs_;
+  size_t size_ = 0;
+  std::shared_ptr<const void> storage_;
+};
+
+} // namespace ppa
+
+#endif
@@ -2,21 +2,149 @@
 #define PPADETECTOR_SEBBCOMPARATOR_H
 
 #include "BBLoggingPass.h"
+#include "BinaryCache.h"
 #include "Comparator.h"
+#include "Executor.h"
+#include "RunLog.h"
 #include "TestCaseLoader.h"
+#include "TraceStore.h"
+
+#include <algorithm>
+#include <memory>
+#include <string>
+#include <vector>
 
 namespace ppa {
 
+// The behavior of one basic block on one run, reduced to what the similarity
+// test can tell apart: its distinct maximal executions, in canonical order.
+struct BBSignature {
+  uint64_t hash;
+  uint64_t id;
+  std::vector<const BBExecution*> executions;
+};
+
+// Signatures of every executed basic block, sorted by hash.
+using RunSignatures = std::vector<BBSignature>;
+
+// Everything SEBB needs to know about one submission. Collecting it is the
+// expensive part (instrumentation, compilation and one run per test case), so
+// it is done once per submission and then shared by every pair it is in.
+struct SEBBProfile {
+  SEBBProfile() = default;
+  // Signatures point into the logs, so profiles can be moved but not copied.
+  SEBBProfile(SEBBProfile&&) = default;
+  SEBBProfile& operator=(SEBBProfile&&) = default;
+  SEBBProfile(const SEBBProfile&) = delete;
+  SEBBProfile& operator=(const SEBBProfile&) = delete;
+
+  // One log per test case used to build the SEBB relation.
+  std::vector<RunLog> runLogs;
+  // The signatures of runLogs, which point into them.
+  std::vector<RunSignatures> runSignatures;
+  // Trace of the last test case, used for the LCS.
+  ControlFlowTraceLog cftLog;
+  // Largest basic block id seen in any of the logs.
+  uint64_t maxBBID = 0;
+};
+
+struct SEBBScore {
+  size_t pSize = 0;
+  size_t sSize = 0;
+  // The LCS, or bounds on it once the pair is known to pass or fail the
+  // similarity threshold: lcs <= LCS <= lcsUpper.
+  size_t lcs = 0;
+  size_t lcsUpper = 0;
+  // Size of the SEBB matrix built for this pair.
+  size_t matrixBytes = 0;
+
+  bool exact() const { return lcs == lcsUpper; }
+  double similarity() const { return ratio(lcs); }
+  double maxSimilarity() const { return ratio(lcsUpper); }
+
+private:
+  double ratio(size_t length) const {
+    size_t longest = std::max(pSize, sSize);
+    return longest ? (double)length / longest : 1.0;
+  }
+};
+
+struct SEBBOptions {
+  // How many test case runs go in parallel, and how many threads build the
+  // SEBB matrix and compare the traces of a pair (0: one per hardware thread).
+  unsigned numJobs = 0;
+  // Pairs whose SEBB matrix would take more memory than this are rejected.
+  size_t matrixLimit = size_t(1) << 30;
+  // Which executions of each block log their values; see SEBBRuntime.cpp.
+  // Empty leaves it to the environment.
+  std::string sampling;
+  // How the runtime writes the values of an execution: exact or sketch.
+  // Empty leaves it to the environment.
+  std::string values;
+  // Compare with both exact and sketched values and report the difference.
+  bool valueReport = false;
+  // Where to cache instrumented executables (empty: nowhere), and how large
+  // the cache may grow.
+  std::string cacheDir;
+  uint64_t cacheLimit = uint64_t(1) << 30;
+  // Report how many hooks the instrumentation of every program removed.
+  bool hookReport = false;
+  // Where to keep the decoded runs of every executable on every test case
+  // (empty: nowhere).
+  std::string traceStore;
+  // Number the acyclic paths of every function, and have the run on the last
+  // test case trace them instead of every block; see BBLoggingPass.h.
+  bool paths = false;
+  // Only decide whether the similarity of a pair reaches this, computing it
+  // exactly only when that takes the whole LCS (0: always exactly).
+  double threshold = 0;
+  // Two executions match when they share at least inputCutoff of the inputs
+  // and outputCutoff of the outputs of one of them, and two blocks are
+  // similar when at least blockCutoff of their executions have a match in
+  // the other block. With all three at 1, blocks are matched by hashing
+  // their executions instead of comparing every pair.
+  double inputCutoff = 1;
+  double outputCutoff = 1;
+  double blockCutoff = 1;
+};
+
 class SEBBComparator : public Comparator<BBLoggingPass, BBLoggingPass> {
 public:
-  SEBBComparator(TestCaseLoader& loader);
+  SEBBComparator(TestCaseLoader& loader, Executor& executor,
+                 const SEBBOptions& options = {});
   void compareModules(llvm::Module& p, llvm::Module& s) override;
   ~SEBBComparator() = default;
 
+  // Instruments m and builds it into the program called exePath.
+  void buildModule(llvm::Module& m, llvm::StringRef exePath);
+  // Runs every executable on every test case, in parallel.
+  std::vector<SEBBProfile>
+  profileExecutables(llvm::ArrayRef<std::string> exePaths);
+  SEBBProfile profileModule(llvm::Module& m, llvm::StringRef exePath);
+  SEBBScore compareProfiles(const SEBBProfile& p, const SEBBProfile& s);
+
+  // Has buildModule also build every program with reference and check that
+  // both builds log the same traces on every test case.
+  void setReferenceExecutor(Executor& reference) { reference_ = &reference; }
+
 private:
+  void reportValueModes(llvm::ArrayRef<std::string> exePaths);
+  void verifyBuild(llvm::StringRef exePath, llvm::StringRef referencePath);
+
   TestCaseLoader& loader_;
+  Executor& executor_;
+  Executor* reference_ = nullptr;
+  std::unique_ptr<BinaryCache> cache_;
+  std::unique_ptr<TraceStore> traceStore_;
+  SEBBOptions options_;
+  // Whether the cutoffs allow matching blocks by their signatures.
+  bool exactSimilarity_;
+  // Environment of the instrumented runs, minus the trace buffer path.
+  std::vector<std::string> environment_;
+  // The value mode of the runs being profiled.
+  std::string values_;
 };
 
 } // namespace ppa
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,64 @@
+#ifndef PPADETECTOR_SEBBMATRIX_H
+#define PPADETECTOR_SEBBMATRIX_H
+
+#include <cstdint>
+#include <cstdlib>
+#include <memory>
+
+namespace ppa {
+
+// Accumulates, for every pair of plaintiff and suspicious basic blocks, the
+// number of test cases on which they behaved the same, and then thresholds it
+// into the SEBB relation. Basic block ids are dense (1..N), so both are flat
+// row-major matrices with rows padded to whole cache lines.
+class SEBBMatrix {
+public:
+  using Count = uint16_t;
+
+  // Rows are plaintiff ids 1..numP, columns suspicious ids 1..numS.
+  SEBBMatrix(uint64_t numP, uint64_t numS);
+
+  static size_t memoryUsage(uint64_t numP, uint64_t numS);
+  size_t memoryUsage() const { return memoryUsage(numP_, numS_); }
+  uint64_t numP() const { return numP_; }
+  uint64_t numS() const { return numS_; }
+
+  void increment(uint64_t p, uint64_t s) {
+    Count& count = counts_.get()[p * countStride_ + s];
+    if (count != Count(~0)) {
+      count++;
+    }
+  }
+
+  Count count(uint64_t p, uint64_t s) const {
+    return counts_.get()[p * countStride_ + s];
+  }
+
+  // Sets the relation to every pair whose count is at least threshold, on up
+  // to numJobs threads (0: one per hardware thread).
+  void computeRelation(double threshold, unsigned numJobs = 1);
+
+  bool related(uint64_t p, uint64_t s) const {
+    if (p > numP_ || s > numS_) {
+      return relatedOutOfRange_;
+    }
+    return (relation_.get()[p * relationStride_ + s / 64] >> (s % 64)) & 1;
+  }
+
+private:
+  struct FreeDeleter {
+    void operator()(void* ptr) const { std::free(ptr); }
+  };
+
+  uint64_t numP_;
+  uint64_t numS_;
+  size_t countStride_;
+  size_t relationStride_;
+  bool relatedOutOfRange_ = false;
+  std::unique_ptr<Count[], FreeDeleter> counts_;
+  std::unique_ptr<uint64_t[], FreeDeleter> relation_;
+};
+
+} // namespace ppa
+
+#endif
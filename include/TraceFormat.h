@@ -0,0 +1,269 @@
+#ifndef PPADETECTOR_TRACEFORMAT_H
+#define PPADETECTOR_TRACEFORMAT_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+
+// Wire format of the traces written by the SEBB runtime. This header is shared
+// by the runtime and the detector, so it only depends on the C++ library.
+//
+// A trace starts with a header: the magic "PPAT" and the format version as a
+// little-endian uint32_t. Then come the events. Each is a tag byte whose low
+// two bits are the kind of event and whose upper six bits are its payload,
+// unless that is 63 or more; in that case the bits are all set and the
+// payload follows as ULEB128.
+//
+//   Exit       zigzag-encoded difference to the id of the previous exit
+//   Input      a value read by the block
+//   Output     a value produced by the block
+//   Extension  a record selected by the payload, followed by its operands
+//              as ULEB128; 0 ends the trace, so that a zero-filled tail (a
+//              run that died) reads as the end
+//
+// An exit whose values were not sampled is written as the SkippedExit
+// extension, with the same delta-coded id as an exit as its operand.
+//
+// Values that are known when the program is instrumented are not logged by
+// every execution. Instead the runtime starts the trace with a ConstantInput
+// or ConstantOutput extension for each, with the id of the block and the
+// value as operands, and every logged execution of that block has them. A
+// value that is both an input and an output of a block is written once, as
+// the InputOutput extension with the value as operand.
+//
+// When the runtime sketches values, a block writes a Sketch extension right
+// before every logged exit instead of its Input and Output events. Its
+// operands are the sketches of the inputs and of the outputs, each the number
+// of values as ULEB128 and then the values as ULEB128 if there are at most
+// kSketchSize of them, or else the multiset hash and the min-hashes as
+// little-endian uint64_t. They leave out the constants of the block, which
+// the reader adds.
+//
+// Entering a block is not recorded: a block logs its values right before it
+// exits, after every block it called has exited, so the exits alone delimit
+// the executions and give the control flow trace.
+//
+// A trace of paths (see BBLoggingPass.h) logs no values. It starts with a
+// PathTable extension, whose operands are a number of words and then the
+// words: the Ball-Larus numbering of every function traced by paths. Blocks
+// of those functions do not exit; a Path extension stands for the blocks of
+// an acyclic path instead, with the zigzag-encoded difference to the number
+// of the previous path as its operand, and PathRepeat for its operand more
+// runs of the path before it, back to back. Other functions exit as usual.
+
+namespace ppa {
+
+constexpr char kTraceMagic[4] = {'P', 'P', 'A', 'T'};
+constexpr uint32_t kTraceVersion = 5;
+constexpr size_t kTraceHeaderSize = 8;
+
+enum TraceEventKind : uint8_t {
+  kTraceExtension = 0,
+  kTraceExit = 1,
+  kTraceInput = 2,
+  kTraceOutput = 3,
+};
+
+enum TraceExtension : uint64_t {
+  kTraceEnd = 0,
+  kTraceSkippedExit = 1,
+  kTraceSketch = 2,
+  kTraceConstantInput = 3,
+  kTraceConstantOutput = 4,
+  kTraceInputOutput = 5,
+  kTracePathTable = 6,
+  kTracePath = 7,
+  kTracePathRepeat = 8,
+};
+
+constexpr uint64_t kTraceInlinePayloadLimit = 63;
+// The longest event: a tag and a 64-bit ULEB128 payload, or an extension with
+// an inline selector and one such operand.
+constexpr size_t kTraceMaxEventSize = 1 + 10;
+// The longest constant: an extension with an inline selector and two operands.
+constexpr size_t kTraceMaxConstantSize = 1 + 2 * 10;
+
+inline uint64_t zigzagEncode(int64_t value) {
+  return (uint64_t(value) << 1) ^ uint64_t(value >> 63);
+}
+
+inline int64_t zigzagDecode(uint64_t value) {
+  return int64_t(value >> 1) ^ -int64_t(value & 1);
+}
+
+// Number of min-hashes in a sketch.
+constexpr unsigned kSketchSize = 4;
+
+// A fixed-size summary of a multiset of values: its size, an order
+// independent hash that is equal for equal multisets, and, for every one of
+// kSketchSize hash functions, the smallest hash of a value. The latter make
+// one-sided containment tests and overlap estimates possible.
+struct ValueSketch {
+  uint64_t size = 0;
+  uint64_t hash = 0;
+  uint64_t minHashes[kSketchSize];
+
+  ValueSketch() {
+    for (auto& minHash : minHashes) {
+      minHash = ~uint64_t(0);
+    }
+  }
+
+  // The splitmix64 finalizer.
+  static uint64_t mix(uint64_t value) {
+    value = (value ^ (value >> 30)) * 0xBF58476D1CE4E5B9;
+    value = (value ^ (value >> 27)) * 0x94D049BB133111EB;
+    return value ^ (value >> 31);
+  }
+
+  void add(uint64_t value) {
+    size++;
+    hash += mix(value);
+    for (unsigned i = 0; i < kSketchSize; i++) {
+      uint64_t minHash = mix(value + (i + 1) * 0x9E3779B97F4A7C15);
+      if (minHash < minHashes[i]) {
+        minHashes[i] = minHash;
+      }
+    }
+  }
+};
+
+// The longest encoding of the inputs and outputs sketches of a Sketch event.
+constexpr size_t kTraceMaxSketchSize = 2 * (10 + 8 * (1 + kSketchSize));
+static_assert(10 * kSketchSize <= 8 * (1 + kSketchSize),
+              "Few values must not take longer to write than their sketch");
+
+inline uint8_t* writeTraceHeader(uint8_t* out) {
+  std::memcpy(out, kTraceMagic, sizeof(kTraceMagic));
+  for (unsigned i = 0; i < 4; i++) {
+    out[sizeof(kTraceMagic) + i] = uint8_t(kTraceVersion >> (8 * i));
+  }
+  return out + kTraceHeaderSize;
+}
+
+// Returns the format version of a trace, or 0 if it does not start with a
+// trace header at all.
+inline uint32_t readTraceVersion(const uint8_t* data, size_t size) {
+  if (size < kTraceHeaderSize ||
+      std::memcmp(data, kTraceMagic, sizeof(kTraceMagic)) != 0) {
+    return 0;
+  }
+  uint32_t version = 0;
+  for (unsigned i = 0; i < 4; i++) {
+    version |= uint32_t(data[sizeof(kTraceMagic) + i]) << (8 * i);
+  }
+  return version;
+}
+
+inline uint8_t* encodeTraceVarint(uint8_t* out, uint64_t value) {
+  do {
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    *out++ = value ? byte | 0x80 : byte;
+  } while (value);
+  return out;
+}
+
+// Writes one event at out, which must have kTraceMaxEventSize bytes of room,
+// and returns the end of it.
+inline uint8_t* encodeTraceEvent(uint8_t* out, TraceEventKind kind,
+                                 uint64_t payload) {
+  if (payload < kTraceInlinePayloadLimit) {
+    *out++ = uint8_t(kind | (payload << 2));
+    return out;
+  }
+  *out++ = uint8_t(kind | (kTraceInlinePayloadLimit << 2));
+  return encodeTraceVarint(out, payload);
+}
+
+// Writes the sketch of a multiset whose first values are firstValues.
+inline uint8_t* encodeValueSketch(uint8_t* out, const ValueSketch& sketch,
+                                  const uint64_t* firstValues) {
+  out = encodeTraceVarint(out, sketch.size);
+  if (sketch.size <= kSketchSize) {
+    for (uint64_t i = 0; i < sketch.size; i++) {
+      out = encodeTraceVarint(out, firstValues[i]);
+    }
+    return out;
+  }
+  auto encodeWord = [&](uint64_t word) {
+    for (unsigned i = 0; i < 8; i++) {
+      *out++ = uint8_t(word >> (8 * i));
+    }
+  };
+  encodeWord(sketch.hash);
+  for (auto minHash : sketch.minHashes) {
+    encodeWord(minHash);
+  }
+  return out;
+}
+
+// Reads a ULEB128 value at pos and advances past it. Returns false if it is
+// cut short.
+inline bool decodeTraceVarint(const uint8_t*& pos, const uint8_t* end,
+                              uint64_t& value) {
+  value = 0;
+  for (unsigned shift = 0; pos != end && shift < 64; shift += 7) {
+    uint8_t byte = *pos++;
+    value |= uint64_t(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+inline bool decodeValueSketch(const uint8_t*& pos, const uint8_t* end,
+                              ValueSketch& sketch) {
+  sketch = ValueSketch();
+  uint64_t size;
+  if (!decodeTraceVarint(pos, end, size)) {
+    return false;
+  }
+  if (size <= kSketchSize) {
+    for (uint64_t i = 0; i < size; i++) {
+      uint64_t value;
+      if (!decodeTraceVarint(pos, end, value)) {
+        return false;
+      }
+      sketch.add(value);
+    }
+    return true;
+  }
+  sketch.size = size;
+  if (size_t(end - pos) < 8 * (1 + kSketchSize)) {
+    return false;
+  }
+  auto decodeWord = [&]() {
+    uint64_t word = 0;
+    for (unsigned i = 0; i < 8; i++) {
+      word |= uint64_t(*pos++) << (8 * i);
+    }
+    return word;
+  };
+  sketch.hash = decodeWord();
+  for (auto& minHash : sketch.minHashes) {
+    minHash = decodeWord();
+  }
+  return true;
+}
+
+// Reads the event at pos and advances past it. Returns false at the end of
+// the data or if the last event is cut short.
+inline bool decodeTraceEvent(const uint8_t*& pos, const uint8_t* end,
+                             TraceEventKind& kind, uint64_t& payload) {
+  if (pos == end) {
+    return false;
+  }
+  uint8_t tag = *pos++;
+  kind = TraceEventKind(tag & 3);
+  payload = tag >> 2;
+  if (payload < kTraceInlinePayloadLimit) {
+    return true;
+  }
+  return decodeTraceVarint(pos, end, payload);
+}
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,44 @@
+#ifndef PPADETECTOR_TRACESTORE_H
+#define PPADETECTOR_TRACESTORE_H
+
+#include "RunLog.h"
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+
+namespace ppa {
+
+// A directory of decoded runs, so that a program is run on a test case once
+// however often it is compared: typically a reference solution against many
+// submissions. Entries are keyed by hashes of the instrumented executable, of
+// the test case and of the runtime configuration, and hold the arrays of a
+// RunLog or ControlFlowTraceLog as they are laid out in memory, so that they
+// are mapped and used in place. Several detector processes may share a store:
+// entries are written to a temporary file and renamed into place.
+class TraceStore {
+public:
+  explicit TraceStore(llvm::StringRef directory);
+
+  static std::string computeKey(llvm::StringRef binaryHash,
+                                llvm::StringRef testCaseHash,
+                                llvm::StringRef config);
+
+  // Map the entry stored under key into log. Return false on a miss.
+  bool lookup(llvm::StringRef key, RunLog& log) const;
+  bool lookup(llvm::StringRef key, ControlFlowTraceLog& log) const;
+
+  void store(llvm::StringRef key, const RunLog& log);
+  void store(llvm::StringRef key, const ControlFlowTraceLog& log);
+
+private:
+  std::string getEntryPath(llvm::StringRef key,
+                           llvm::StringRef extension) const;
+  void write(llvm::StringRef entryPath, uint64_t flags,
+             llvm::ArrayRef<llvm::ArrayRef<uint8_t>> arrays);
+
+  std::string directory_;
+};
+
+} // namespace ppa
+
+#endif
@@ -0,0 +1,96 @@
+#include "BinaryCache.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/Support/CachePruning.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <unistd.h>
+
+#include <chrono>
+
+using namespace llvm;
+namespace ppa {
+
+// pruneCache only considers files with this prefix.
+static const char* kEntryPrefix = "llvmcache-";
+static const char* kTemporaryPrefix = "llvmcache-tmp-";
+
+static const sys::fs::perms kExecutablePermissions =
+    sys::fs::all_read | sys::fs::all_exe | sys::fs::owner_write;
+
+BinaryCache::BinaryCache(StringRef directory, uint64_t sizeLimit)
+    : directory_(directory), sizeLimit_(sizeLimit) {
+  if (auto error = sys::fs::create_directories(directory_)) {
+    report_fatal_error("Unable to create the cache directory " +
+                       Twine(directory_) + ": " + error.message());
+  }
+}
+
+std::string BinaryCache::computeKey(const Module& m, StringRef buildKey) {
+  SmallVector<char, 0> bitcode;
+  raw_svector_ostream os(bitcode);
+  WriteBitcodeToFile(m, os);
+  std::string material = toHex(SHA1::hash(arrayRefFromStringRef(os.str())));
+  material += ";";
+  material += buildKey;
+  return toHex(SHA1::hash(arrayRefFromStringRef(material)));
+}
+
+std::string BinaryCache::getEntryPath(StringRef key) const {
+  SmallString<128> path(directory_);
+  sys::path::append(path, kEntryPrefix + key);
+  return std::string(path.str());
+}
+
+bool BinaryCache::fetch(StringRef key, StringRef exePath) {
+  std::string entryPath = getEntryPath(key);
+  sys::fs::remove(exePath);
+  // A hard link keeps the executable even if the entry is evicted meanwhile.
+  if (sys::fs::create_hard_link(entryPath, exePath)) {
+    if (sys::fs::copy_file(entryPath, exePath) ||
+        sys::fs::setPermissions(exePath, kExecutablePermissions)) {
+      sys::fs::remove(exePath);
+      return false;
+    }
+  }
+
+  // Entries are evicted by last access, which the file system may not track.
+  int fd;
+  if (!sys::fs::openFileForRead(entryPath, fd)) {
+    auto now = std::chrono::system_clock::now();
+    sys::fs::setLastAccessAndModificationTime(fd, now, now);
+    close(fd);
+  }
+  return true;
+}
+
+void BinaryCache::store(StringRef key, StringRef exePath) {
+  SmallString<128> model(directory_);
+  sys::path::append(model, Twine(kTemporaryPrefix) + "%%%%%%%%%%%%");
+  int fd;
+  SmallString<128> temporaryPath;
+  if (sys::fs::createUniqueFile(model, fd, temporaryPath)) {
+    errs() << "Unable to add " << exePath << " to the cache.\n";
+    return;
+  }
+  close(fd);
+
+  if (sys::fs::copy_file(exePath, temporaryPath) ||
+      sys::fs::setPermissions(temporaryPath, kExecutablePermissions) ||
+      sys::fs::rename(temporaryPath, getEntryPath(key))) {
+    errs() << "Unable to add " << exePath << " to the cache.\n";
+    sys::fs::remove(temporaryPath);
+    return;
+  }
+
+  CachePruningPolicy policy;
+  policy.Interval = std::chrono::seconds(0);
+  policy.MaxSizeBytes = sizeLimit_;
+  pruneCache(directory_, policy);
+}
+
+} // namespace ppa
@@ -0,0 +1,17 @@
+#include "FileHash.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/SHA1.h"
+
+using namespace llvm;
+namespace ppa {
+
+std::string hashFile(StringRef path) {
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    return "";
+  }
+  return toHex(SHA1::hash(arrayRefFromStringRef((*buffer)->getBuffer())));
+}
+
+} // namespace ppa
@@ -1,8 +1,11 @@
 #include "InstHistComparator.h"
-#include "llvm/IR/LegacyPassManager.h"
+#include "Parallel.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
+#include <algorithm>
 #include <cmath>
-#include <numeric>
 
 using namespace llvm;
 namespace ppa {
@@ -16,60 +19,118 @@ static void insertIntoHistogram(InstHistogram& histogram, unsigned int opcode,
   iter->second += count;
 }
 
-static void normalizeHistogram(InstHistogram& histogram) {
-  auto sum = std::accumulate(
-      histogram.begin(), histogram.end(), 0.0,
-      [](const auto& acc, const auto& iter) { return acc + iter.second; });
-  for (auto& [opcode, count] : histogram) {
-    count /= sum;
+Expected<InstHistogram> computeHistogram(StringRef path,
+                                         LLVMContext& context) {
+  SMDiagnostic err;
+  std::unique_ptr<Module> module = getLazyIRFileModule(path, err, context);
+  if (!module) {
+    std::string message;
+    raw_string_ostream os(message);
+    err.print(nullptr, os);
+    return createStringError(inconvertibleErrorCode(), os.str());
   }
+
+  InstHistogram histogram;
+  for (auto& f : *module) {
+    if (Error error = f.materialize()) {
+      return std::move(error);
+    }
+    for (auto& bb : f) {
+      for (auto& i : bb) {
+        insertIntoHistogram(histogram, i.getOpcode());
+      }
+    }
+    // Nothing else reads the body, so free it before the next one is read.
+    f.deleteBody();
+  }
+  return histogram;
 }
 
-static double computeChiSquareDistance(InstHistogram& p, InstHistogram& s) {
-  normalizeHistogram(p);
-  normalizeHistogram(s);
-  InstHistogram merged;
-  for (const auto& [opcode, count] : p) {
-    insertIntoHistogram(merged, opcode, count);
+DenseInstHistogram densifyHistogram(const InstHistogram& histogram) {
+  DenseInstHistogram dense;
+  double sum = 0.0;
+  for (const auto& [opcode, count] : histogram) {
+    sum += count;
   }
-  for (const auto& [opcode, count] : s) {
-    insertIntoHistogram(merged, opcode, count);
+  for (const auto& [opcode, count] : histogram) {
+    if (opcode < kInstHistWidth) {
+      dense.frequencies[opcode] = count / sum;
+    }
   }
-  double result = 0.0;
-  for (const auto& [opcode, count] : merged) {
-    double diff = p.lookup(opcode) - s.lookup(opcode);
-    result += diff * diff / count;
+  return dense;
+}
+
+float compareDenseHistograms(const DenseInstHistogram& p,
+                             const DenseInstHistogram& s) {
+  // One partial sum per lane, so that the loop vectorizes without the
+  // compiler having to reassociate a floating point reduction.
+  float partial[kInstHistLanes] = {};
+  for (size_t i = 0; i < kInstHistWidth; i += kInstHistLanes) {
+    for (size_t lane = 0; lane < kInstHistLanes; lane++) {
+      float a = p.frequencies[i + lane], b = s.frequencies[i + lane];
+      float sum = a + b, diff = a - b;
+      // Opcodes that neither has add 0 / 1.
+      partial[lane] += diff * diff / (sum + (sum == 0));
+    }
   }
-  return result / 2;
+  float distance = 0;
+  for (auto term : partial) {
+    distance += term;
+  }
+  return 1 - distance / 2;
 }
 
-char InstHistPass::ID = 0;
+size_t InstHistBatch::add(const InstHistogram& histogram) {
+  histograms_.push_back(densifyHistogram(histogram));
+  return histograms_.size() - 1;
+}
 
-bool InstHistPass::runOnModule(Module& m) {
-  for (auto& f : m) {
-    for (auto& bb : f) {
-      for (auto& i : bb) {
-        handleInstruction(&i);
-      }
-    }
+size_t InstHistBatch::add(const DenseInstHistogram& histogram) {
+  histograms_.push_back(histogram);
+  return histograms_.size() - 1;
+}
+
+std::vector<float>
+InstHistBatch::computeSimilarities(const DenseInstHistogram& query) const {
+  std::vector<float> similarities(histograms_.size());
+  for (size_t i = 0; i < histograms_.size(); i++) {
+    similarities[i] = compareDenseHistograms(query, histograms_[i]);
   }
-  return false;
+  return similarities;
 }
 
-void InstHistPass::handleInstruction(llvm::Instruction* i) {
-  auto opcode = i->getOpcode();
-  insertIntoHistogram(*histogram, opcode);
+std::vector<std::pair<size_t, float>>
+InstHistBatch::findMostSimilar(const DenseInstHistogram& query,
+                               size_t k) const {
+  std::vector<float> similarities = computeSimilarities(query);
+  std::vector<std::pair<size_t, float>> best;
+  best.reserve(similarities.size());
+  for (size_t i = 0; i < similarities.size(); i++) {
+    best.emplace_back(i, similarities[i]);
+  }
+  k = std::min(k, best.size());
+  std::partial_sort(best.begin(), best.begin() + k, best.end(),
+                    [](const auto& a, const auto& b) {
+                      return a.second > b.second ||
+                             (a.second == b.second && a.first < b.first);
+                    });
+  best.resize(k);
+  return best;
 }
 
-void InstHistComparator::compareModules(Module& p, Module& s) {
-  InstHistogram pHist, sHist;
-  legacy::PassManager ppm, spm;
-  ppm.add(new PlaintiffPass(&pHist));
-  spm.add(new SuspiciousPass(&sHist));
-  ppm.run(p);
-  spm.run(s);
-  double score = 1.0 - computeChiSquareDistance(pHist, sHist);
-  outs() << (int)(std::round(score * 100)) << "%\n";
+std::vector<float> InstHistBatch::computeMatrix(unsigned numJobs) const {
+  size_t n = histograms_.size();
+  std::vector<float> matrix(n * n);
+  // The distance is symmetric, so row i fills the cells right of the
+  // diagonal and their mirror images; every cell is written once.
+  parallelFor(numJobs, 0, n, [&](size_t i) {
+    matrix[i * n + i] = 1;
+    for (size_t j = i + 1; j < n; j++) {
+      matrix[i * n + j] = matrix[j * n + i] =
+          compareDenseHistograms(histograms_[i], histograms_[j]);
+    }
+  });
+  return matrix;
 }
 
 } // namespace ppa
\ No newline at end of file
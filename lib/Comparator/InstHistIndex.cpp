@@ -0,0 +1,313 @@
+#include "InstHistIndex.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstring>
+#include <functional>
+#include <limits>
+
+using namespace llvm;
+namespace ppa {
+
+// The file is the magic "PPAI", the index version and the histogram width as
+// uint32_t, then one record per submission: the sizes of its key and name as
+// uint32_t, the key, the name and the frequencies as floats. Everything is in
+// the byte order and layout of the host.
+constexpr char kIndexMagic[4] = {'P', 'P', 'A', 'I'};
+// Bump whenever the layout of the records or the histograms change.
+constexpr uint32_t kIndexVersion = 1;
+constexpr size_t kIndexHeaderSize = sizeof(kIndexMagic) + 2 * sizeof(uint32_t);
+
+// Entries added since the tree was built are searched one by one, until
+// there are this many of them.
+constexpr size_t kMaxPending = 256;
+// A search computes at most this many distances to the tree's entries, so
+// that indexes of up to this many are searched in full.
+constexpr size_t kMaxVisits = 4096;
+// How many candidates per requested neighbor are ranked by chi-square.
+constexpr size_t kCandidateFactor = 4;
+
+static DenseInstHistogram computeRoots(const DenseInstHistogram& histogram) {
+  DenseInstHistogram roots;
+  for (size_t i = 0; i < kInstHistWidth; i++) {
+    roots.frequencies[i] = std::sqrt(histogram.frequencies[i]);
+  }
+  return roots;
+}
+
+// Euclidean distance of two vectors of roots, which is sqrt(2) times the
+// Hellinger distance of their histograms.
+static float computeDistance(const DenseInstHistogram& a,
+                             const DenseInstHistogram& b) {
+  // One partial sum per lane, as in compareDenseHistograms.
+  float partial[kInstHistLanes] = {};
+  for (size_t i = 0; i < kInstHistWidth; i += kInstHistLanes) {
+    for (size_t lane = 0; lane < kInstHistLanes; lane++) {
+      float diff = a.frequencies[i + lane] - b.frequencies[i + lane];
+      partial[lane] += diff * diff;
+    }
+  }
+  float sum = 0;
+  for (auto term : partial) {
+    sum += term;
+  }
+  return std::sqrt(sum);
+}
+
+template <typename T>
+static void appendBytes(std::string& out, const T& value) {
+  out.append(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+InstHistIndex::InstHistIndex(StringRef path) : path_(path) {
+  if (!sys::fs::exists(path_)) {
+    create();
+  }
+  load();
+  rebuild();
+}
+
+// The header is written to a temporary file that is then linked into place,
+// so that another process never sees the index without its header, nor
+// appends a record that a late header would overwrite.
+void InstHistIndex::create() {
+  SmallString<128> model(path_);
+  model += ".tmp-%%%%%%%%%%%%";
+  int fd;
+  SmallString<128> temporaryPath;
+  if (auto error = sys::fs::createUniqueFile(model, fd, temporaryPath)) {
+    report_fatal_error("Unable to create the instruction histogram index " +
+                       Twine(path_) + ": " + error.message());
+  }
+  {
+    raw_fd_ostream os(fd, /*shouldClose=*/true);
+    uint32_t width = kInstHistWidth;
+    os.write(kIndexMagic, sizeof(kIndexMagic));
+    os.write(reinterpret_cast<const char*>(&kIndexVersion),
+             sizeof(kIndexVersion));
+    os.write(reinterpret_cast<const char*>(&width), sizeof(width));
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      sys::fs::remove(temporaryPath);
+      report_fatal_error("Unable to create the instruction histogram index " +
+                         Twine(path_));
+    }
+  }
+  // Whoever links first creates the index; the others use theirs.
+  std::error_code error = sys::fs::create_hard_link(temporaryPath, path_);
+  sys::fs::remove(temporaryPath);
+  if (error && error != std::errc::file_exists) {
+    report_fatal_error("Unable to create the instruction histogram index " +
+                       Twine(path_) + ": " + error.message());
+  }
+}
+
+void InstHistIndex::load() {
+  auto buffer = MemoryBuffer::getFile(path_);
+  if (!buffer) {
+    report_fatal_error("Unable to read the instruction histogram index " +
+                       Twine(path_) + ": " + buffer.getError().message());
+  }
+  StringRef data = (*buffer)->getBuffer();
+  uint32_t version = 0, width = 0;
+  if (data.size() >= kIndexHeaderSize) {
+    std::memcpy(&version, data.data() + sizeof(kIndexMagic), sizeof(version));
+    std::memcpy(&width, data.data() + sizeof(kIndexMagic) + sizeof(version),
+                sizeof(width));
+  }
+  if (!data.startswith(StringRef(kIndexMagic, sizeof(kIndexMagic))) ||
+      version != kIndexVersion || width != kInstHistWidth) {
+    report_fatal_error("The instruction histogram index " + Twine(path_) +
+                       " was written by another version of ppa-detector.");
+  }
+
+  // A record cut short by a crash while it was appended is ignored.
+  size_t offset = kIndexHeaderSize;
+  size_t histogramSize = kInstHistWidth * sizeof(float);
+  while (data.size() - offset >= 2 * sizeof(uint32_t)) {
+    uint32_t keySize, nameSize;
+    std::memcpy(&keySize, data.data() + offset, sizeof(keySize));
+    std::memcpy(&nameSize, data.data() + offset + sizeof(keySize),
+                sizeof(nameSize));
+    offset += 2 * sizeof(uint32_t);
+    if (data.size() - offset < uint64_t(keySize) + nameSize + histogramSize) {
+      break;
+    }
+    Entry entry;
+    entry.key = data.substr(offset, keySize).str();
+    entry.name = data.substr(offset + keySize, nameSize).str();
+    offset += keySize + nameSize;
+    std::memcpy(entry.histogram.frequencies, data.data() + offset,
+                histogramSize);
+    offset += histogramSize;
+    if (!byKey_.count(entry.key)) {
+      add(std::move(entry));
+    }
+  }
+}
+
+const DenseInstHistogram* InstHistIndex::lookup(StringRef key) const {
+  auto it = byKey_.find(key);
+  return it == byKey_.end() ? nullptr : &entries_[it->second].histogram;
+}
+
+void InstHistIndex::insert(StringRef key, StringRef name,
+                           const DenseInstHistogram& histogram) {
+  if (byKey_.count(key)) {
+    return;
+  }
+
+  // The record goes out in a single write, so that records appended by
+  // several processes do not interleave.
+  std::string record;
+  appendBytes(record, static_cast<uint32_t>(key.size()));
+  appendBytes(record, static_cast<uint32_t>(name.size()));
+  record += key;
+  record += name;
+  appendBytes(record, histogram.frequencies);
+  int fd;
+  if (sys::fs::openFileForWrite(path_, fd, sys::fs::CD_OpenExisting,
+                                sys::fs::OF_Append)) {
+    errs() << "Unable to add " << name
+           << " to the instruction histogram index.\n";
+  } else {
+    raw_fd_ostream os(fd, /*shouldClose=*/true, /*unbuffered=*/true);
+    os << record;
+    os.close();
+    if (os.has_error()) {
+      os.clear_error();
+      errs() << "Unable to add " << name
+             << " to the instruction histogram index.\n";
+    }
+  }
+
+  Entry entry;
+  entry.key = key.str();
+  entry.name = name.str();
+  entry.histogram = histogram;
+  add(std::move(entry));
+  pending_.push_back(entries_.size() - 1);
+  if (pending_.size() > kMaxPending) {
+    rebuild();
+  }
+}
+
+void InstHistIndex::add(Entry entry) {
+  entry.roots = computeRoots(entry.histogram);
+  byKey_[entry.key] = entries_.size();
+  entries_.push_back(std::move(entry));
+}
+
+int32_t InstHistIndex::build(std::vector<std::pair<float, uint32_t>>& points,
+                             size_t begin, size_t end) {
+  if (begin == end) {
+    return -1;
+  }
+  // The last point is the vantage, and the others are split at their median
+  // distance to it.
+  uint32_t vantage = points[end - 1].second;
+  for (size_t i = begin; i < end - 1; i++) {
+    points[i].first = computeDistance(entries_[vantage].roots,
+                                      entries_[points[i].second].roots);
+  }
+  size_t middle = begin + (end - 1 - begin) / 2;
+  std::nth_element(points.begin() + begin, points.begin() + middle,
+                   points.begin() + end - 1);
+  float radius = middle < end - 1 ? points[middle].first : 0;
+
+  int32_t node = nodes_.size();
+  nodes_.push_back({vantage, radius, -1, -1});
+  int32_t inside = build(points, begin, middle);
+  int32_t outside = build(points, middle, end - 1);
+  nodes_[node].inside = inside;
+  nodes_[node].outside = outside;
+  return node;
+}
+
+void InstHistIndex::rebuild() {
+  std::vector<std::pair<float, uint32_t>> points;
+  points.reserve(entries_.size());
+  for (size_t i = 0; i < entries_.size(); i++) {
+    points.emplace_back(0, i);
+  }
+  nodes_.clear();
+  nodes_.reserve(entries_.size());
+  root_ = build(points, 0, points.size());
+  pending_.clear();
+}
+
+std::vector<std::pair<size_t, float>>
+InstHistIndex::findNearest(const DenseInstHistogram& query, size_t k) const {
+  DenseInstHistogram roots = computeRoots(query);
+  size_t numCandidates = k * kCandidateFactor;
+  // The candidates so far, as a max-heap by distance.
+  std::vector<std::pair<float, uint32_t>> candidates;
+  auto consider = [&](uint32_t i, float distance) {
+    if (candidates.size() < numCandidates) {
+      candidates.emplace_back(distance, i);
+      std::push_heap(candidates.begin(), candidates.end());
+    } else if (distance < candidates.front().first) {
+      std::pop_heap(candidates.begin(), candidates.end());
+      candidates.back() = {distance, i};
+      std::push_heap(candidates.begin(), candidates.end());
+    }
+  };
+  auto farthest = [&]() {
+    return candidates.size() < numCandidates
+               ? std::numeric_limits<float>::infinity()
+               : candidates.front().first;
+  };
+
+  if (numCandidates) {
+    for (auto i : pending_) {
+      consider(i, computeDistance(roots, entries_[i].roots));
+    }
+    // Subtrees to visit, with a lower bound on the distance to their entries
+    // from the triangle inequality, as a min-heap by bound: the most
+    // promising subtree is visited first, which matters once the search is
+    // cut short.
+    std::vector<std::pair<float, int32_t>> queue;
+    auto push = [&](int32_t index, float bound) {
+      if (index >= 0) {
+        queue.emplace_back(bound, index);
+        std::push_heap(queue.begin(), queue.end(), std::greater<>());
+      }
+    };
+    push(root_, 0);
+    size_t visits = 0;
+    while (!queue.empty() && visits < kMaxVisits) {
+      std::pop_heap(queue.begin(), queue.end(), std::greater<>());
+      auto [bound, index] = queue.back();
+      queue.pop_back();
+      if (bound >= farthest()) {
+        break;
+      }
+      const Node& node = nodes_[index];
+      float distance = computeDistance(roots, entries_[node.vantage].roots);
+      visits++;
+      consider(node.vantage, distance);
+      push(node.inside, std::max(bound, distance - node.radius));
+      push(node.outside, std::max(bound, node.radius - distance));
+    }
+  }
+
+  std::vector<std::pair<size_t, float>> nearest;
+  for (auto [distance, i] : candidates) {
+    nearest.emplace_back(i,
+                         compareDenseHistograms(query, entries_[i].histogram));
+  }
+  std::sort(nearest.begin(), nearest.end(), [](const auto& a, const auto& b) {
+    return a.second > b.second || (a.second == b.second && a.first < b.first);
+  });
+  nearest.resize(std::min(k, nearest.size()));
+  return nearest;
+}
+
+} // namespace ppa
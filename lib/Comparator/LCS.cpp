@@ -0,0 +1,489 @@
+#include "LCS.h"
+#include "Parallel.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/Support/MathExtras.h"
+
+#include <algorithm>
+#include <vector>
+
+using namespace llvm;
+namespace ppa {
+
+// Upper bound on the memory spent on precomputed match vectors. Rows whose
+// symbol does not fit are rebuilt from the occurrence lists every time.
+constexpr size_t kMatchVectorBudget = 256 * 1024 * 1024;
+// Longest loop body looked for when compressing traces. Looking for bodies
+// takes time linear in this.
+constexpr size_t kMaxPeriod = 64;
+// Below this many DP cells, compressing the traces saves less than it costs.
+constexpr size_t kMinCompressedCells = size_t(1) << 24;
+// Tiles of the wavefront LCS are this many words of columns wide, so that
+// their slice of V stays in L1, and this many rows high.
+constexpr size_t kTileWords = 512;
+constexpr size_t kTileRows = 2048;
+// Below this many DP cells, starting threads costs more than they save.
+constexpr size_t kMinWavefrontCells = size_t(1) << 28;
+// The bounded LCS checks whether it is decided at least this often, in rows.
+constexpr size_t kMinCheckRows = 64;
+
+size_t computeLCSNaive(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                       BBRelation related) {
+  std::vector<size_t> dp_data[2];
+  dp_data[0].resize(p.size() + 1);
+  dp_data[1].resize(p.size() + 1);
+
+  auto dp = [&](size_t i, size_t j) -> size_t& { return dp_data[i % 2][j]; };
+
+  for (size_t i = 1; i <= s.size(); i++) {
+    for (size_t j = 1; j <= p.size(); j++) {
+      if (related(p[j - 1], s[i - 1])) {
+        dp(i, j) = dp(i - 1, j - 1) + 1;
+      } else {
+        dp(i, j) = std::max(dp(i - 1, j), dp(i, j - 1));
+      }
+    }
+  }
+
+  return dp(s.size(), p.size());
+}
+
+namespace {
+
+// For every symbol of the row trace, the set of columns it matches, as a bit
+// vector over the column trace.
+class MatchVectors {
+public:
+  MatchVectors(ArrayRef<uint64_t> cols, ArrayRef<uint64_t> rows,
+               BBRelation related)
+      : numWords_((cols.size() + 63) / 64), scratch_(numWords_) {
+    for (size_t j = 0; j < cols.size(); j++) {
+      occurrences_[cols[j]].push_back(j);
+    }
+
+    DenseMap<uint64_t, size_t> frequency;
+    for (auto row : rows) {
+      frequency[row]++;
+    }
+    // Frequent symbols get a precomputed vector first.
+    std::vector<std::pair<size_t, uint64_t>> byFrequency;
+    for (auto& [symbol, count] : frequency) {
+      byFrequency.emplace_back(count, symbol);
+    }
+    std::sort(byFrequency.rbegin(), byFrequency.rend());
+
+    size_t budget = kMatchVectorBudget / sizeof(uint64_t);
+    for (auto& [count, symbol] : byFrequency) {
+      Entry& entry = entries_[symbol];
+      for (auto& [col, positions] : occurrences_) {
+        if (related(col, symbol)) {
+          entry.positions.push_back(&positions);
+        }
+      }
+      if (entry.positions.empty() || budget < numWords_) {
+        continue;
+      }
+      budget -= numWords_;
+      entry.bits.resize(numWords_);
+      fill(entry, entry.bits.data(), 0, numWords_);
+      entry.positions.clear();
+    }
+  }
+
+  size_t numWords() const { return numWords_; }
+
+  // Whether symbol matches any column.
+  bool matchesAny(uint64_t symbol) const {
+    const Entry& entry = entries_.find(symbol)->second;
+    return !entry.bits.empty() || !entry.positions.empty();
+  }
+
+  // Returns the match vector of symbol, or nullptr if it matches nothing.
+  const uint64_t* lookup(uint64_t symbol) {
+    return lookup(symbol, 0, numWords_, scratch_.data());
+  }
+
+  // Returns words [first, first + count) of the match vector of symbol, or
+  // nullptr if it matches nothing at all. Vectors that were not precomputed
+  // are rebuilt into scratch, which must have room for count words.
+  const uint64_t* lookup(uint64_t symbol, size_t first, size_t count,
+                         uint64_t* scratch) const {
+    const Entry& entry = entries_.find(symbol)->second;
+    if (!entry.bits.empty()) {
+      return entry.bits.data() + first;
+    }
+    if (entry.positions.empty()) {
+      return nullptr;
+    }
+    std::fill(scratch, scratch + count, 0);
+    fill(entry, scratch, first, count);
+    return scratch;
+  }
+
+private:
+  struct Entry {
+    std::vector<uint64_t> bits;
+    std::vector<const std::vector<uint32_t>*> positions;
+  };
+
+  static void fill(const Entry& entry, uint64_t* bits, size_t first,
+                   size_t count) {
+    uint64_t begin = first * 64, end = (first + count) * 64;
+    for (auto* positions : entry.positions) {
+      auto j = std::lower_bound(positions->begin(), positions->end(), begin);
+      for (; j != positions->end() && *j < end; ++j) {
+        bits[*j / 64 - first] |= uint64_t(1) << (*j % 64);
+      }
+    }
+  }
+
+  size_t numWords_;
+  DenseMap<uint64_t, std::vector<uint32_t>> occurrences_;
+  DenseMap<uint64_t, Entry> entries_;
+  std::vector<uint64_t> scratch_;
+};
+
+// Advances words [0, numWords) of V by one row whose match vector is m, given
+// the carry into the first word, and returns the carry out of the last.
+inline uint64_t advanceRow(uint64_t* v, const uint64_t* m, size_t numWords,
+                           uint64_t carry) {
+  // V' = (V + (V & M)) | (V & ~M), with the carry rippling across words.
+  for (size_t w = 0; w < numWords; w++) {
+    uint64_t u = v[w] & m[w];
+    uint64_t sum = v[w] + u;
+    uint64_t carryOut = sum < u;
+    sum += carry;
+    carryOut |= sum < carry;
+    v[w] = sum | (v[w] & ~m[w]);
+    carry = carryOut;
+  }
+  return carry;
+}
+
+// The LCS is the number of zero bits in V.
+size_t countLCS(ArrayRef<uint64_t> v) {
+  size_t ones = 0;
+  for (auto word : v) {
+    ones += __builtin_popcountll(word);
+  }
+  return v.size() * 64 - ones;
+}
+
+} // namespace
+
+size_t computeLCSBitParallel(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                             BBRelation related) {
+  // The shorter trace becomes the bit vector, which keeps the match vectors
+  // small; LCS is symmetric once the relation is transposed.
+  if (p.size() > s.size()) {
+    auto transposed = [&](uint64_t sBB, uint64_t pBB) {
+      return related(pBB, sBB);
+    };
+    return computeLCSBitParallel(s, p, transposed);
+  }
+  if (p.empty()) {
+    return 0;
+  }
+
+  MatchVectors matches(p, s, related);
+  size_t numWords = matches.numWords();
+
+  // V has a zero bit in every column where the DP row steps up. Padding bits
+  // past p.size() never match and so stay one.
+  std::vector<uint64_t> v(numWords, ~uint64_t(0));
+
+  for (auto symbol : s) {
+    if (const uint64_t* m = matches.lookup(symbol)) {
+      advanceRow(v.data(), m, numWords, 0);
+    }
+  }
+  return countLCS(v);
+}
+
+size_t computeLCSWavefront(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                           BBRelation related, unsigned numJobs) {
+  if (p.size() > s.size()) {
+    auto transposed = [&](uint64_t sBB, uint64_t pBB) {
+      return related(pBB, sBB);
+    };
+    return computeLCSWavefront(s, p, transposed, numJobs);
+  }
+  if (p.empty()) {
+    return 0;
+  }
+
+  const MatchVectors matches(p, s, related);
+  size_t numWords = matches.numWords();
+  std::vector<uint64_t> v(numWords, ~uint64_t(0));
+  // The carry of every row out of the last tile to its left.
+  std::vector<uint8_t> carries(s.size());
+
+  // Tile (r, c) needs V from tile (r - 1, c) and the carries of its rows
+  // from tile (r, c - 1), so the tiles of an anti-diagonal are independent
+  // and each writes a slice of V and of the carries of its own.
+  size_t numColumnTiles = divideCeil(numWords, kTileWords);
+  size_t numRowTiles = divideCeil(s.size(), kTileRows);
+  for (size_t diagonal = 0; diagonal < numRowTiles + numColumnTiles - 1;
+       diagonal++) {
+    size_t first =
+        diagonal < numColumnTiles ? 0 : diagonal - numColumnTiles + 1;
+    size_t last = std::min(diagonal, numRowTiles - 1);
+    parallelFor(numJobs, first, last + 1, [&](size_t rowTile) {
+      size_t firstWord = (diagonal - rowTile) * kTileWords;
+      size_t count = std::min(kTileWords, numWords - firstWord);
+      uint64_t scratch[kTileWords];
+      size_t end = std::min(s.size(), (rowTile + 1) * kTileRows);
+      for (size_t i = rowTile * kTileRows; i < end; i++) {
+        if (auto* m = matches.lookup(s[i], firstWord, count, scratch)) {
+          carries[i] = advanceRow(v.data() + firstWord, m, count, carries[i]);
+        }
+      }
+    });
+  }
+  return countLCS(v);
+}
+
+// Shortens trace without changing its LCS with other, given that trace[i]
+// and other[j] match iff related(trace[i], other[j]).
+//
+// A position that matches nothing in other is never in a common
+// subsequence. A common subsequence that uses m copies of a body repeated k
+// times matches some position of other in each of them, so m is at most the
+// number c of positions of other that the body matches. As the copies are
+// identical, it may as well use the first m, and the repeats after the
+// first c can go.
+static std::vector<uint64_t> compressTrace(ArrayRef<uint64_t> trace,
+                                           ArrayRef<uint64_t> other,
+                                           BBRelation related) {
+  DenseMap<uint64_t, unsigned> otherIndex;
+  std::vector<size_t> otherCounts;
+  for (auto symbol : other) {
+    auto [entry, inserted] = otherIndex.try_emplace(symbol, otherCounts.size());
+    if (inserted) {
+      otherCounts.push_back(0);
+    }
+    otherCounts[entry->second]++;
+  }
+
+  // The symbols of other that every symbol of trace matches.
+  DenseMap<uint64_t, std::vector<unsigned>> partners;
+  std::vector<uint64_t> kept;
+  kept.reserve(trace.size());
+  for (auto symbol : trace) {
+    auto [entry, inserted] = partners.try_emplace(symbol);
+    if (inserted) {
+      for (auto& [otherSymbol, index] : otherIndex) {
+        if (related(symbol, otherSymbol)) {
+          entry->second.push_back(index);
+        }
+      }
+    }
+    if (!entry->second.empty()) {
+      kept.push_back(symbol);
+    }
+  }
+
+  std::vector<uint64_t> compressed;
+  compressed.reserve(kept.size());
+  std::vector<size_t> seen(otherCounts.size());
+  size_t epoch = 0;
+  for (size_t i = 0; i < kept.size();) {
+    // The body whose back to back repeats cover the most from i on.
+    size_t period = 0, copies = 1;
+    for (size_t q = 1; q <= kMaxPeriod && i + 2 * q <= kept.size(); q++) {
+      size_t end = i + q;
+      while (end < kept.size() && kept[end] == kept[end - q]) {
+        end++;
+      }
+      size_t n = (end - i) / q;
+      if (n >= 2 && n * q > copies * period) {
+        period = q;
+        copies = n;
+      }
+    }
+    if (!period) {
+      compressed.push_back(kept[i++]);
+      continue;
+    }
+
+    epoch++;
+    size_t matched = 0;
+    for (size_t j = i; j < i + period; j++) {
+      for (auto index : partners[kept[j]]) {
+        if (seen[index] != epoch) {
+          seen[index] = epoch;
+          matched += otherCounts[index];
+        }
+      }
+    }
+    for (size_t n = std::min(copies, matched); n; n--) {
+      compressed.insert(compressed.end(), kept.begin() + i,
+                        kept.begin() + i + period);
+    }
+    i += copies * period;
+  }
+  return compressed;
+}
+
+static void compressTraces(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                           BBRelation related,
+                           std::vector<uint64_t>& pCompressed,
+                           std::vector<uint64_t>& sCompressed) {
+  auto transposed = [&](uint64_t sBB, uint64_t pBB) {
+    return related(pBB, sBB);
+  };
+  // The LCS of the compressed p with s is that of p with s, so s can be
+  // compressed against the compressed p, which bounds its loops tighter.
+  pCompressed = compressTrace(p, s, related);
+  sCompressed = compressTrace(s, pCompressed, transposed);
+}
+
+static bool useWavefront(size_t numCells, unsigned numJobs) {
+  return numCells >= kMinWavefrontCells && resolveNumJobs(numJobs) > 1;
+}
+
+size_t computeLCSCompressed(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                            BBRelation related, unsigned numJobs) {
+  std::vector<uint64_t> pCompressed, sCompressed;
+  compressTraces(p, s, related, pCompressed, sCompressed);
+  if (useWavefront(pCompressed.size() * sCompressed.size(), numJobs)) {
+    return computeLCSWavefront(pCompressed, sCompressed, related, numJobs);
+  }
+  return computeLCSBitParallel(pCompressed, sCompressed, related);
+}
+
+size_t computeLCS(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                  BBRelation related, unsigned numJobs) {
+  if (p.size() * s.size() < kMinCompressedCells) {
+    return computeLCSBitParallel(p, s, related);
+  }
+  return computeLCSCompressed(p, s, related, numJobs);
+}
+
+// Upper bound on the LCS from how often every symbol occurs: a position is
+// in a common subsequence at most once, and only along with a position of
+// the other trace that it matches.
+static size_t countBound(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                         BBRelation related) {
+  DenseMap<uint64_t, size_t> pCounts, sCounts;
+  for (auto symbol : p) {
+    pCounts[symbol]++;
+  }
+  for (auto symbol : s) {
+    sCounts[symbol]++;
+  }
+
+  // For every symbol of s, how many positions of p it matches.
+  DenseMap<uint64_t, size_t> sPartners;
+  size_t pBound = 0;
+  for (auto& [pSymbol, pCount] : pCounts) {
+    size_t partners = 0;
+    for (auto& [sSymbol, sCount] : sCounts) {
+      if (related(pSymbol, sSymbol)) {
+        partners += sCount;
+        sPartners[sSymbol] += pCount;
+      }
+    }
+    pBound += std::min(pCount, partners);
+  }
+  size_t sBound = 0;
+  for (auto& [sSymbol, sCount] : sCounts) {
+    sBound += std::min(sCount, sPartners.lookup(sSymbol));
+  }
+  return std::min(pBound, sBound);
+}
+
+// The k-th pair of a common subsequence of length L of p and s, at column j
+// and row i, has k - 1 pairs before it and L - k after it, so
+// L - |s| <= j - i <= |p| - L. If the LCS reaches target, it is thus the LCS
+// of the DP restricted to the diagonals target - |s| to |p| - target, and
+// otherwise that restricted LCS is below target as well. The band is
+// widened to whole words, which changes neither.
+static LCSBounds computeLCSBanded(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                                  BBRelation related, size_t target,
+                                  size_t upper) {
+  if (p.size() > s.size()) {
+    auto transposed = [&](uint64_t sBB, uint64_t pBB) {
+      return related(pBB, sBB);
+    };
+    return computeLCSBanded(s, p, transposed, target, upper);
+  }
+
+  const MatchVectors matches(p, s, related);
+  size_t numWords = matches.numWords();
+  std::vector<uint64_t> v(numWords, ~uint64_t(0));
+  std::vector<uint64_t> scratch(numWords);
+
+  // Every row adds at most one to the LCS, and only if it matches something,
+  // so the rows left that do bound how far it can still grow.
+  size_t matchable = 0;
+  for (auto symbol : s) {
+    matchable += matches.matchesAny(symbol);
+  }
+  size_t bandWords = (p.size() + s.size() - 2 * target) / 64 + 2;
+  size_t checkRows = std::max(kMinCheckRows, numWords / bandWords);
+
+  for (size_t i = 0; i < s.size(); i++) {
+    if (i % checkRows == 0) {
+      // Once the band holds target, it holds the whole LCS.
+      size_t lcs = countLCS(v);
+      if (lcs >= target) {
+        return {lcs, std::min(upper, lcs + matchable)};
+      }
+      if (lcs + matchable < target) {
+        return {lcs, std::min(upper, target - 1)};
+      }
+    }
+    // Columns i + target - |s| to i + |p| - target; see above.
+    size_t first = i + target > s.size() ? i + target - s.size() : 0;
+    size_t last = std::min(p.size() - 1, i + p.size() - target);
+    size_t firstWord = first / 64;
+    size_t count = last / 64 - firstWord + 1;
+    if (auto* m = matches.lookup(s[i], firstWord, count, scratch.data())) {
+      // Past the band V is still all ones, which absorbs the carry.
+      advanceRow(v.data() + firstWord, m, count, 0);
+      matchable--;
+    }
+  }
+  size_t lcs = countLCS(v);
+  return {lcs, lcs >= target ? lcs : std::min(upper, target - 1)};
+}
+
+LCSBounds computeLCSBounded(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s,
+                            BBRelation related, size_t target,
+                            unsigned numJobs) {
+  if (target == 0) {
+    size_t lcs = computeLCS(p, s, related, numJobs);
+    return {lcs, lcs};
+  }
+  LCSBounds bounds{0, std::min(p.size(), s.size())};
+  if (bounds.upper < target) {
+    return bounds;
+  }
+  bounds.upper = std::min(bounds.upper, countBound(p, s, related));
+  if (bounds.upper < target) {
+    return bounds;
+  }
+  if (p.size() * s.size() < kMinCompressedCells) {
+    return computeLCSBanded(p, s, related, target, bounds.upper);
+  }
+
+  std::vector<uint64_t> pCompressed, sCompressed;
+  compressTraces(p, s, related, pCompressed, sCompressed);
+  size_t shorter = std::min(pCompressed.size(), sCompressed.size());
+  size_t longer = std::max(pCompressed.size(), sCompressed.size());
+  bounds.upper = std::min(bounds.upper, shorter);
+  if (bounds.upper < target) {
+    return bounds;
+  }
+  // A band over most of the DP saves less than spreading it over threads.
+  if (2 * (shorter + longer - 2 * target) > shorter &&
+      useWavefront(shorter * longer, numJobs)) {
+    size_t lcs =
+        computeLCSWavefront(pCompressed, sCompressed, related, numJobs);
+    return {lcs, lcs};
+  }
+  return computeLCSBanded(pCompressed, sCompressed, related, target,
+                          bounds.upper);
+}
+
+} // namespace ppa
@@ -0,0 +1,542 @@
+#include "RunLog.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <memory>
+
+using namespace llvm;
+namespace ppa {
+
+constexpr size_t kMaxReservedEvents = 1 << 20;
+
+// Returns the events of a trace, past its header. Traces written by another
+// version of the runtime cannot be read, and mixing them up with ours would
+// silently give wrong results, so they are rejected.
+static ArrayRef<uint8_t> getTraceEvents(ArrayRef<uint8_t> trace) {
+  if (trace.empty()) {
+    return {};
+  }
+  uint32_t version = readTraceVersion(trace.data(), trace.size());
+  if (version == 0) {
+    report_fatal_error("Not an SEBB trace; was the program instrumented by an "
+                       "older version of ppa-detector?");
+  }
+  if (version != kTraceVersion) {
+    report_fatal_error("Unsupported SEBB trace format version " +
+                       Twine(version) + " (expected " + Twine(kTraceVersion) +
+                       ")");
+  }
+  return trace.drop_front(kTraceHeaderSize);
+}
+
+// The arrays of a decoded RunLog.
+struct DecodedRunLog {
+  std::vector<uint64_t> values;
+  std::vector<ValueSketch> sketches;
+  std::vector<BBExecution> executions;
+  std::vector<uint64_t> offsets;
+  std::vector<uint64_t> blocks;
+};
+
+RunLog RunLog::decode(ArrayRef<uint8_t> trace) {
+  RunLog log;
+  ArrayRef<uint8_t> events = getTraceEvents(trace);
+  auto storage = std::make_shared<DecodedRunLog>();
+  auto& values = storage->values;
+  auto& sketches = storage->sketches;
+  auto& offsets = storage->offsets;
+  auto& blocks = storage->blocks;
+
+  // Every event takes at least a byte, so reserving that much up front
+  // allocates every array once for all but huge traces.
+  size_t maxEvents = std::min<size_t>(events.size(), kMaxReservedEvents);
+  values.reserve(maxEvents);
+  std::vector<BBExecution> executions;
+  executions.reserve(maxEvents);
+  std::vector<uint64_t> ids;
+  ids.reserve(maxEvents);
+  std::vector<uint64_t> outputs;
+
+  // Index + 1 of the last logged execution of every block, which skipped
+  // executions are attributed to.
+  std::vector<size_t> lastLogged;
+  // The sketches written for the next exit, if the values are sketched.
+  ValueSketch inputSketch, outputSketch;
+  // The values every logged execution of a block has besides those it logs.
+  std::vector<std::vector<uint64_t>> constantInputs, constantOutputs;
+
+  // The executions kept so far, by a hash of their block and values. An
+  // execution that has the same values as an earlier one of its block only
+  // adds to its count, so a log grows with the distinct behaviors of every
+  // block rather than with how often it ran.
+  DenseMap<uint64_t, SmallVector<size_t, 1>> distinct;
+  auto getBytes = [&](const BBExecution& e) {
+    if (log.sketched_) {
+      return makeArrayRef(reinterpret_cast<const uint8_t*>(&sketches[e.begin]),
+                          2 * sizeof(ValueSketch));
+    }
+    return makeArrayRef(reinterpret_cast<const uint8_t*>(&values[e.begin]),
+                        (e.numInputs + e.numOutputs) * sizeof(uint64_t));
+  };
+
+  // A block logs its values right before it exits, after every block it
+  // called has exited, so the pending values always belong to the next exit
+  // and no stack is needed.
+  uint64_t begin = 0;
+  uint64_t lastExit = 0;
+  const uint8_t* pos = events.begin();
+  TraceEventKind kind;
+  uint64_t payload;
+  while (decodeTraceEvent(pos, events.end(), kind, payload)) {
+    if (kind == kTraceExtension && payload == kTraceSketch) {
+      if (!decodeValueSketch(pos, events.end(), inputSketch) ||
+          !decodeValueSketch(pos, events.end(), outputSketch)) {
+        break;
+      }
+      log.sketched_ = true;
+    } else if (kind == kTraceExtension &&
+               (payload == kTraceConstantInput ||
+                payload == kTraceConstantOutput)) {
+      uint64_t id, value;
+      if (!decodeTraceVarint(pos, events.end(), id) ||
+          !decodeTraceVarint(pos, events.end(), value)) {
+        break;
+      }
+      auto& constants = payload == kTraceConstantInput ? constantInputs
+                                                       : constantOutputs;
+      if (id >= constants.size()) {
+        constants.resize(id + 1);
+      }
+      constants[id].push_back(value);
+    } else if (kind == kTraceExtension && payload == kTraceInputOutput) {
+      if (!decodeTraceVarint(pos, events.end(), payload)) {
+        break;
+      }
+      values.push_back(payload);
+      outputs.push_back(payload);
+    } else if (kind == kTraceExtension && payload == kTracePathTable) {
+      report_fatal_error("A trace of paths has no values to decode.");
+    } else if (kind == kTraceExtension) {
+      uint64_t delta;
+      if (payload != kTraceSkippedExit ||
+          !decodeTraceVarint(pos, events.end(), delta)) {
+        break;
+      }
+      lastExit += zigzagDecode(delta);
+      if (lastExit < lastLogged.size() && lastLogged[lastExit]) {
+        executions[lastLogged[lastExit] - 1].count++;
+      }
+      // A skipped execution logs no values.
+      values.resize(begin);
+      outputs.clear();
+    } else if (kind == kTraceExit) {
+      lastExit += zigzagDecode(payload);
+      ArrayRef<uint64_t> moreInputs, moreOutputs;
+      if (lastExit < constantInputs.size()) {
+        moreInputs = constantInputs[lastExit];
+      }
+      if (lastExit < constantOutputs.size()) {
+        moreOutputs = constantOutputs[lastExit];
+      }
+      if (log.sketched_) {
+        for (auto value : moreInputs) {
+          inputSketch.add(value);
+        }
+        for (auto value : moreOutputs) {
+          outputSketch.add(value);
+        }
+        executions.push_back({sketches.size(),
+                              static_cast<uint32_t>(inputSketch.size),
+                              static_cast<uint32_t>(outputSketch.size), 1});
+        sketches.push_back(inputSketch);
+        sketches.push_back(outputSketch);
+        inputSketch = outputSketch = ValueSketch();
+      } else {
+        values.insert(values.end(), moreInputs.begin(), moreInputs.end());
+        outputs.insert(outputs.end(), moreOutputs.begin(), moreOutputs.end());
+        uint32_t numInputs = values.size() - begin;
+        values.insert(values.end(), outputs.begin(), outputs.end());
+        auto inputsBegin = values.begin() + begin;
+        auto outputsBegin = inputsBegin + numInputs;
+        // Values are kept sorted so that they can be compared as multisets.
+        std::sort(inputsBegin, outputsBegin);
+        std::sort(outputsBegin, values.end());
+        executions.push_back(
+            {begin, numInputs, static_cast<uint32_t>(outputs.size()), 1});
+        outputs.clear();
+      }
+
+      const BBExecution& execution = executions.back();
+      ArrayRef<uint8_t> bytes = getBytes(execution);
+      auto& candidates = distinct[hash_combine(
+          lastExit, execution.numInputs,
+          hash_combine_range(bytes.begin(), bytes.end()))];
+      auto same = find_if(candidates, [&](size_t i) {
+        return ids[i] == lastExit &&
+               executions[i].numInputs == execution.numInputs &&
+               getBytes(executions[i]) == bytes;
+      });
+      if (lastExit >= lastLogged.size()) {
+        lastLogged.resize(lastExit + 1);
+      }
+      if (same != candidates.end()) {
+        executions[*same].count++;
+        executions.pop_back();
+        if (log.sketched_) {
+          sketches.resize(sketches.size() - 2);
+        } else {
+          values.resize(begin);
+        }
+        lastLogged[lastExit] = *same + 1;
+      } else {
+        candidates.push_back(executions.size() - 1);
+        ids.push_back(lastExit);
+        begin = values.size();
+        lastLogged[lastExit] = executions.size();
+      }
+    } else if (kind == kTraceOutput) {
+      outputs.push_back(payload);
+    } else {
+      values.push_back(payload);
+    }
+  }
+  // Values of a block that never exited are dropped.
+  values.resize(begin);
+
+  // Group the executions by block with a counting sort, keeping them in the
+  // order they first ran.
+  uint64_t maxID = ids.empty() ? 0 : *std::max_element(ids.begin(), ids.end());
+  offsets.assign(maxID + 2, 0);
+  for (auto id : ids) {
+    offsets[id + 1]++;
+  }
+  for (uint64_t id = 0; id <= maxID; id++) {
+    if (offsets[id + 1]) {
+      blocks.push_back(id);
+    }
+    offsets[id + 1] += offsets[id];
+  }
+  std::vector<uint64_t> next(offsets.begin(), offsets.end() - 1);
+  storage->executions.resize(executions.size());
+  for (size_t i = 0; i < executions.size(); i++) {
+    storage->executions[next[ids[i]]++] = executions[i];
+  }
+
+  // The log lives as long as its profile, and dedup usually leaves a small
+  // fraction of what was reserved for the events.
+  values.shrink_to_fit();
+  sketches.shrink_to_fit();
+  blocks.shrink_to_fit();
+
+  log.values_ = values;
+  log.sketches_ = sketches;
+  log.executions_ = storage->executions;
+  log.offsets_ = offsets;
+  log.blocks_ = blocks;
+  log.storage_ = std::move(storage);
+  return log;
+}
+
+namespace {
+
+// Turns the paths of a trace back into the blocks on them, following the
+// numbering in its PathTable (see BBLoggingPass.h). Every distinct path is
+// only walked once.
+class PathExpander {
+public:
+  // Reads the operands of a PathTable extension at pos.
+  bool readTable(const uint8_t*& pos, const uint8_t* end);
+  // Sets blocks to the ids of the blocks on path.
+  bool expand(uint64_t path, ArrayRef<uint64_t>& blocks);
+
+private:
+  struct Function {
+    uint64_t firstPath;
+    std::vector<uint64_t> ids;
+    // The edges out of every node as (increment, target), by increment.
+    std::vector<std::vector<std::pair<uint64_t, uint64_t>>> edges;
+  };
+
+  std::vector<Function> functions_;
+  DenseMap<uint64_t, std::vector<uint64_t>> expanded_;
+};
+
+} // namespace
+
+bool PathExpander::readTable(const uint8_t*& pos, const uint8_t* end) {
+  uint64_t numWords;
+  if (!decodeTraceVarint(pos, end, numWords)) {
+    return false;
+  }
+  std::vector<uint64_t> words;
+  words.reserve(std::min<uint64_t>(numWords, end - pos));
+  for (uint64_t i = 0; i < numWords; i++) {
+    uint64_t word;
+    if (!decodeTraceVarint(pos, end, word)) {
+      return false;
+    }
+    words.push_back(word);
+  }
+
+  size_t i = 0;
+  auto next = [&](uint64_t& word) {
+    if (i == words.size()) {
+      return false;
+    }
+    word = words[i++];
+    return true;
+  };
+  while (i < words.size()) {
+    Function function;
+    uint64_t numBlocks, numEdges;
+    if (!next(function.firstPath) || !next(numBlocks) ||
+        numBlocks > words.size()) {
+      return false;
+    }
+    function.ids.resize(numBlocks);
+    for (auto& id : function.ids) {
+      if (!next(id)) {
+        return false;
+      }
+    }
+    function.edges.resize(numBlocks + 2);
+    if (!next(numEdges)) {
+      return false;
+    }
+    for (uint64_t edge = 0; edge < numEdges; edge++) {
+      uint64_t from, to, increment;
+      if (!next(from) || !next(to) || !next(increment) ||
+          from > numBlocks + 1 || to > numBlocks + 1) {
+        return false;
+      }
+      function.edges[from].push_back({increment, to});
+    }
+    for (auto& edges : function.edges) {
+      llvm::sort(edges);
+    }
+    functions_.push_back(std::move(function));
+  }
+  return true;
+}
+
+bool PathExpander::expand(uint64_t path, ArrayRef<uint64_t>& blocks) {
+  auto it = expanded_.find(path);
+  if (it == expanded_.end()) {
+    auto function =
+        llvm::upper_bound(functions_, path, [](uint64_t path, auto& function) {
+          return path < function.firstPath;
+        });
+    if (function == functions_.begin()) {
+      return false;
+    }
+    --function;
+
+    // From the start node, every step takes the edge with the largest
+    // increment that is not more than what is left of the number.
+    std::vector<uint64_t> onPath;
+    uint64_t rest = path - function->firstPath;
+    uint64_t exit = function->ids.size() + 1;
+    for (uint64_t node = 0, steps = 0; node != exit; steps++) {
+      auto& edges = function->edges[node];
+      auto edge = llvm::upper_bound(edges, rest, [](uint64_t rest, auto& edge) {
+        return rest < edge.first;
+      });
+      if (edge == edges.begin() || steps > exit) {
+        return false;
+      }
+      --edge;
+      rest -= edge->first;
+      node = edge->second;
+      if (node != exit) {
+        onPath.push_back(function->ids[node - 1]);
+      }
+    }
+    if (rest) {
+      return false;
+    }
+    it = expanded_.insert({path, std::move(onPath)}).first;
+  }
+  blocks = it->second;
+  return true;
+}
+
+namespace {
+
+// The arrays of a decoded ControlFlowTraceLog.
+struct DecodedControlFlowTrace {
+  std::vector<uint64_t> pool;
+  std::vector<ControlFlowTraceLog::Run> runs;
+};
+
+// Collects the pool and the runs of a ControlFlowTraceLog.
+class RunBuilder {
+public:
+  // Appends an id that exited on its own.
+  void addBlock(uint64_t id);
+  // Appends count takes of path, whose blocks are blocks.
+  void addPath(uint64_t path, ArrayRef<uint64_t> blocks, uint64_t count);
+
+  std::vector<uint64_t> pool;
+  std::vector<ControlFlowTraceLog::Run> runs;
+
+private:
+  // Where the blocks of every path with a run are in the pool.
+  DenseMap<uint64_t, uint64_t> pooled_;
+  // Whether the last run holds ids appended one by one, and may grow.
+  bool open_ = false;
+};
+
+} // namespace
+
+// A run takes three words, and may force the single ids after it into a run
+// of their own, three words more; shorter stretches are stored expanded.
+constexpr uint64_t kMinRunBlocks = 7;
+
+void RunBuilder::addBlock(uint64_t id) {
+  if (!open_) {
+    runs.push_back({pool.size(), 0, 1});
+    open_ = true;
+  }
+  pool.push_back(id);
+  runs.back().length++;
+}
+
+void RunBuilder::addPath(uint64_t path, ArrayRef<uint64_t> blocks,
+                         uint64_t count) {
+  if (blocks.size() * count < kMinRunBlocks) {
+    for (uint64_t i = 0; i < count; i++) {
+      for (auto id : blocks) {
+        addBlock(id);
+      }
+    }
+    return;
+  }
+  auto [it, inserted] = pooled_.insert({path, pool.size()});
+  if (inserted) {
+    pool.insert(pool.end(), blocks.begin(), blocks.end());
+  }
+  if (!open_ && !runs.empty() && runs.back().first == it->second &&
+      runs.back().length == blocks.size()) {
+    runs.back().count += count;
+  } else {
+    runs.push_back({it->second, blocks.size(), count});
+  }
+  open_ = false;
+}
+
+bool ControlFlowTraceLog::computeSize() {
+  size_ = 0;
+  for (auto& run : runs_) {
+    if (run.first > pool_.size() || run.length > pool_.size() - run.first) {
+      return false;
+    }
+    size_ += run.length * run.count;
+  }
+  return true;
+}
+
+ArrayRef<uint64_t>
+ControlFlowTraceLog::ids(std::vector<uint64_t>& scratch) const {
+  if (size_ == pool_.size() && runs_.size() <= 1) {
+    return pool_;
+  }
+  scratch.clear();
+  scratch.reserve(size_);
+  for (auto& run : runs_) {
+    auto blocks = pool_.slice(run.first, run.length);
+    for (uint64_t i = 0; i < run.count; i++) {
+      scratch.insert(scratch.end(), blocks.begin(), blocks.end());
+    }
+  }
+  return scratch;
+}
+
+ControlFlowTraceLog ControlFlowTraceLog::decode(ArrayRef<uint8_t> trace) {
+  RunBuilder builder;
+  ArrayRef<uint8_t> events = getTraceEvents(trace);
+
+  // the dynamic CFG almost forms a tree, and
+  // we only report the post-order traversal
+  uint64_t lastExit = 0;
+  PathExpander paths;
+  uint64_t lastPath = 0;
+  const uint8_t* pos = events.begin();
+  TraceEventKind kind;
+  uint64_t payload;
+  while (decodeTraceEvent(pos, events.end(), kind, payload)) {
+    if (kind == kTraceExtension && payload == kTracePathTable) {
+      if (!paths.readTable(pos, events.end())) {
+        break;
+      }
+      continue;
+    } else if (kind == kTraceExtension && payload == kTracePath) {
+      uint64_t delta;
+      if (!decodeTraceVarint(pos, events.end(), delta)) {
+        break;
+      }
+      lastPath += zigzagDecode(delta);
+      ArrayRef<uint64_t> blocks;
+      if (!paths.expand(lastPath, blocks)) {
+        break;
+      }
+      builder.addPath(lastPath, blocks, 1);
+      continue;
+    } else if (kind == kTraceExtension && payload == kTracePathRepeat) {
+      uint64_t count;
+      ArrayRef<uint64_t> blocks;
+      if (!decodeTraceVarint(pos, events.end(), count) ||
+          !paths.expand(lastPath, blocks)) {
+        break;
+      }
+      builder.addPath(lastPath, blocks, count);
+      continue;
+    } else if (kind == kTraceExtension && payload == kTraceSketch) {
+      ValueSketch sketch;
+      if (!decodeValueSketch(pos, events.end(), sketch) ||
+          !decodeValueSketch(pos, events.end(), sketch)) {
+        break;
+      }
+      continue;
+    } else if (kind == kTraceExtension &&
+               (payload == kTraceConstantInput ||
+                payload == kTraceConstantOutput)) {
+      uint64_t operand;
+      if (!decodeTraceVarint(pos, events.end(), operand) ||
+          !decodeTraceVarint(pos, events.end(), operand)) {
+        break;
+      }
+      continue;
+    } else if (kind == kTraceExtension && payload == kTraceInputOutput) {
+      if (!decodeTraceVarint(pos, events.end(), payload)) {
+        break;
+      }
+      continue;
+    } else if (kind == kTraceExtension) {
+      if (payload != kTraceSkippedExit ||
+          !decodeTraceVarint(pos, events.end(), payload)) {
+        break;
+      }
+    }
+    if (kind == kTraceExtension || kind == kTraceExit) {
+      lastExit += zigzagDecode(payload);
+      builder.addBlock(lastExit);
+    }
+  }
+
+  auto storage = std::make_shared<DecodedControlFlowTrace>();
+  storage->pool = std::move(builder.pool);
+  storage->runs = std::move(builder.runs);
+  ControlFlowTraceLog log;
+  log.pool_ = storage->pool;
+  log.runs_ = storage->runs;
+  log.computeSize();
+  log.storage_ = std::move(storage);
+  return log;
+}
+
+} // namespace ppa
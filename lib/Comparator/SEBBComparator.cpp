@@ -1,9 +1,17 @@
 #include "SEBBComparator.h"
-#include "Compiler.h"
+#include "FileHash.h"
+#include "LCS.h"
+#include "SEBBMatrix.h"
+#include "Parallel.h"
+#include "llvm/ADT/Hashing.h"
+#include "llvm/ADT/SmallString.h"
 #include "llvm/IR/LegacyPassManager.h"
 #include "llvm/IR/Verifier.h"
-#include "llvm/Support/Program.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/MathExtras.h"
 #include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
 
 #include <fcntl.h>
 #include <sys/mman.h>
@@ -11,95 +19,37 @@
 #include <unistd.h>
 
 #include <algorithm>
+#include <chrono>
 #include <cmath>
-#include <list>
 #include <memory>
-#include <stack>
+#include <tuple>
 #include <vector>
 
+extern char** environ;
+
 using namespace llvm;
 namespace ppa {
 
 static const char* kPlaintiffExePath = "/tmp/ppa_detector_plaintiff";
 static const char* kSuspiciousExePath = "/tmp/ppa_detector_suspicious";
-static const char* kLogPath = "/tmp/ppa_detector_log";
-
-constexpr uint32_t kBufferSize = 4 * 1024 * 1024;
-constexpr uint64_t kLogDelimiter = 0xFFFFFFFFFFFFFFFF;
-constexpr uint64_t kEnterBasicBlock = 0xFFFFFFFFFFFFFFFE;
-constexpr uint64_t kExitBasicBlock = 0xFFFFFFFFFFFFFFFD;
-constexpr uint64_t kInputMarker = 0x0000000000000000;
-constexpr uint64_t kOutputMarker = 0x4000000000000000;
-
-constexpr double kInputRatioCutoff = 1.0;
-constexpr double kOutputRatioCutoff = 1.0;
-constexpr double kBBSimilarityCutoff = 1.0;
-
-struct BBLog {
-  std::vector<uint64_t> inputs;
-  std::vector<uint64_t> outputs;
-};
-
-using RunLog = DenseMap<uint64_t, std::list<BBLog>>;
-
-static RunLog readLogFromFile(uint64_t* buffer) {
-  RunLog log;
-
-  uint32_t pos = 0;
-  std::stack<BBLog> stack;
-
-  while (buffer[pos] != kLogDelimiter) {
-    uint64_t op = buffer[pos++];
-    uint64_t val = buffer[pos++];
-
-    if (op == kEnterBasicBlock) {
-      stack.emplace();
-    } else if (op == kExitBasicBlock) {
-      auto bbLog = stack.top();
-      stack.pop();
-      log[val].emplace_back(bbLog);
-    } else if (op & kOutputMarker) {
-      // uint64_t id = op & (~kOutputMarker);
-      stack.top().outputs.emplace_back(val);
-    } else {
-      // uint64_t id = op & (~kInputMarker);
-      stack.top().inputs.emplace_back(val);
-    }
-  }
-
-  return log;
-}
-
-using ControlFlowTraceLog = std::vector<uint64_t>;
-static ControlFlowTraceLog readCFTLogFromFile(uint64_t* buffer) {
-  ControlFlowTraceLog log;
-
-  uint32_t pos = 0;
-  std::stack<BBLog> stack;
-
-  while (buffer[pos] != kLogDelimiter) {
-    uint64_t op = buffer[pos++];
-    uint64_t val = buffer[pos++];
-
-    if (op == kEnterBasicBlock) {
-      // the dynamic CFG almost forms a tree, and
-      // we only report the post-order traversal
-    } else if (op == kExitBasicBlock) {
-      log.emplace_back(val);
-    }
-  }
-
-  return log;
-}
-static int computeIntersection(std::vector<uint64_t>& p,
-                               std::vector<uint64_t>& s) {
+static const char* kLogPrefix = "ppa_detector_log";
+static const char* kLogEnvVar = "PPA_DETECTOR_LOG";
+static const char* kSamplingEnvVar = "PPA_DETECTOR_SAMPLING";
+static const char* kValuesEnvVar = "PPA_DETECTOR_VALUES";
+static const char* kTraceEnvVar = "PPA_DETECTOR_TRACE";
+// Every variable the runtime reads starts with this.
+static const char* kRuntimeEnvPrefix = "PPA_DETECTOR_";
+
+// Pairs of blocks compared by each shard of the SEBB matrix, enough to be
+// worth handing to another thread.
+constexpr size_t kShardPairs = 1024;
+
+// Both p and s must be sorted.
+static int computeIntersection(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s) {
   int cnt = 0;
 
-  std::vector<uint64_t> sortedp(p), sorteds(s);
-  std::sort(sortedp.begin(), sortedp.end());
-  std::sort(sorteds.begin(), sorteds.end());
-  auto firstp = sortedp.begin(), lastp = sortedp.end();
-  auto firsts = sorteds.begin(), lasts = sorteds.end();
+  auto firstp = p.begin(), lastp = p.end();
+  auto firsts = s.begin(), lasts = s.end();
 
   while (firstp != lastp && firsts != lasts) {
     if (*firstp < *firsts) {
@@ -116,158 +66,666 @@ static int computeIntersection(std::vector<uint64_t>& p,
   return cnt;
 }
 
-template <class T>
-static int computeLCS(std::vector<uint64_t>& p, std::vector<uint64_t>& s,
-                      T cmp) {
-  std::vector<int> dp_data[2];
-  dp_data[0].resize(p.size() + 1);
-  dp_data[1].resize(p.size() + 1);
+// Whether the multiset of values sketched by a is contained in that of b. If
+// it is, this always says so; if not, it is only fooled when every min-hash
+// of b misses the values of a that are not in b.
+static bool sketchContainedIn(const ValueSketch& a, const ValueSketch& b) {
+  if (a.size == 0 || b.size == 0) {
+    return a.size == 0 && b.size == 0;
+  } else if (a.size >= b.size) {
+    return a.size == b.size && a.hash == b.hash;
+  }
+  for (unsigned i = 0; i < kSketchSize; i++) {
+    if (b.minHashes[i] > a.minHashes[i]) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  auto dp = [&](int i, int j) -> int& { return dp_data[i % 2][j]; };
+// Estimates the number of values a and b have in common. The share of
+// min-hashes they agree on estimates their Jaccard index.
+static double estimateIntersection(const ValueSketch& a, const ValueSketch& b) {
+  if (a.size == 0 || b.size == 0) {
+    return 0;
+  } else if (sketchContainedIn(a, b)) {
+    return a.size;
+  } else if (sketchContainedIn(b, a)) {
+    return b.size;
+  }
+  unsigned agree = 0;
+  for (unsigned i = 0; i < kSketchSize; i++) {
+    agree += a.minHashes[i] == b.minHashes[i];
+  }
+  double jaccard = (double)agree / kSketchSize;
+  double common = jaccard / (1 + jaccard) * (a.size + b.size);
+  // Equal to the smaller size would mean containment, which was ruled out.
+  return std::min(common, std::min(a.size, b.size) - 0.5);
+}
 
-  for (size_t i = 1; i <= s.size(); i++) {
-    for (size_t j = 1; j <= p.size(); j++) {
-      if (cmp(p[j - 1], s[i - 1])) {
-        dp(i, j) = dp(i - 1, j - 1) + 1;
-      } else {
-        dp(i, j) = std::max(dp(i - 1, j), dp(i, j - 1));
-      }
-    }
+// The numbers of inputs and of outputs that two executions have in common.
+static std::pair<double, double> computeCommonValues(const RunLog& pRun,
+                                                     const BBExecution& p,
+                                                     const RunLog& sRun,
+                                                     const BBExecution& s) {
+  if (pRun.sketched()) {
+    return {estimateIntersection(pRun.inputSketch(p), sRun.inputSketch(s)),
+            estimateIntersection(pRun.outputSketch(p), sRun.outputSketch(s))};
   }
+  return {computeIntersection(pRun.inputs(p), sRun.inputs(s)),
+          computeIntersection(pRun.outputs(p), sRun.outputs(s))};
+}
 
-  return dp(s.size(), p.size());
+// The share of p (or s, depending on total) that the two have in common.
+static double computeRatio(size_t pSize, size_t sSize, double common,
+                           size_t total) {
+  if (pSize == 0 && sSize == 0) {
+    return 1;
+  } else if (pSize == 0 || sSize == 0) {
+    return 0;
+  }
+  return common / total;
 }
 
-static double compareBBSimilarity(std::list<BBLog>& pLogs,
-                                  std::list<BBLog>& sLogs) {
-  int similar = 0;
+// Executions are weighted by the number of executions they stand for, so
+// that sampled runs give the same ratio as full ones would.
+static double compareBBSimilarity(const RunLog& pRun,
+                                  ArrayRef<BBExecution> pLogs,
+                                  const RunLog& sRun,
+                                  ArrayRef<BBExecution> sLogs,
+                                  const SEBBOptions& options) {
+  uint64_t similar = 0, total = 0;
   for (auto& pLog : pLogs) {
+    total += pLog.count;
     for (auto& sLog : sLogs) {
-      int icnt = computeIntersection(pLog.inputs, sLog.inputs);
-      double iratio = 0;
-      if (pLog.inputs.size() == 0 && sLog.inputs.size() == 0) {
-        iratio = 1;
-      } else if (pLog.inputs.size() == 0 || sLog.inputs.size() == 0) {
-        iratio = 0;
-      } else {
-        iratio = (double)icnt / pLog.inputs.size();
-      }
-
-      int ocnt = computeIntersection(pLog.outputs, sLog.outputs);
-      double oratio = 0;
-      if (pLog.outputs.size() == 0 && sLog.outputs.size() == 0) {
-        oratio = 1;
-      } else if (pLog.outputs.size() == 0 || sLog.outputs.size() == 0) {
-        oratio = 0;
-      } else {
-        oratio = (double)ocnt / pLog.outputs.size();
-      }
-      if (iratio >= kInputRatioCutoff && oratio >= kOutputRatioCutoff) {
-        similar++;
+      auto [inputs, outputs] = computeCommonValues(pRun, pLog, sRun, sLog);
+      double iratio = computeRatio(pLog.numInputs, sLog.numInputs, inputs,
+                                   pLog.numInputs);
+      double oratio = computeRatio(pLog.numOutputs, sLog.numOutputs, outputs,
+                                   pLog.numOutputs);
+      if (iratio >= options.inputCutoff && oratio >= options.outputCutoff) {
+        similar += pLog.count;
         break;
       }
     }
   }
   for (auto& sLog : sLogs) {
+    total += sLog.count;
     for (auto& pLog : pLogs) {
-      int icnt = computeIntersection(pLog.inputs, sLog.inputs);
-      double iratio = 0;
-      if (pLog.inputs.size() == 0 && sLog.inputs.size() == 0) {
-        iratio = 1;
-      } else if (pLog.inputs.size() == 0 || sLog.inputs.size() == 0) {
-        iratio = 0;
-      } else {
-        iratio = (double)icnt / sLog.inputs.size();
+      auto [inputs, outputs] = computeCommonValues(pRun, pLog, sRun, sLog);
+      double iratio = computeRatio(pLog.numInputs, sLog.numInputs, inputs,
+                                   sLog.numInputs);
+      double oratio = computeRatio(pLog.numOutputs, sLog.numOutputs, outputs,
+                                   sLog.numOutputs);
+      if (iratio >= options.inputCutoff && oratio >= options.outputCutoff) {
+        similar += sLog.count;
+        break;
       }
+    }
+  }
+  double ratio = (double)similar / total;
+  return (ratio >= options.blockCutoff);
+}
 
-      int ocnt = computeIntersection(pLog.outputs, sLog.outputs);
-      double oratio = 0;
-      if (pLog.outputs.size() == 0 && sLog.outputs.size() == 0) {
-        oratio = 1;
-      } else if (pLog.outputs.size() == 0 || sLog.outputs.size() == 0) {
-        oratio = 0;
-      } else {
-        oratio = (double)ocnt / sLog.outputs.size();
+// Whether the (sorted) values of an execution of p are contained in those of
+// an execution of s, as a cutoff of 1 requires.
+static bool containedIn(ArrayRef<uint64_t> p, ArrayRef<uint64_t> s) {
+  if (p.empty() || s.empty()) {
+    return p.empty() && s.empty();
+  }
+  return std::includes(s.begin(), s.end(), p.begin(), p.end());
+}
+
+static int compareValues(ArrayRef<uint64_t> a, ArrayRef<uint64_t> b) {
+  if (std::lexicographical_compare(a.begin(), a.end(), b.begin(), b.end())) {
+    return -1;
+  }
+  return a == b ? 0 : 1;
+}
+
+// What identifies the values of a sketched execution.
+static auto sketchKey(const RunLog& run, const BBExecution& e) {
+  return std::make_tuple(e.numInputs, run.inputSketch(e).hash, e.numOutputs,
+                         run.outputSketch(e).hash);
+}
+
+static bool sameValues(const RunLog& aRun, const BBExecution& a,
+                       const RunLog& bRun, const BBExecution& b) {
+  if (aRun.sketched()) {
+    return sketchKey(aRun, a) == sketchKey(bRun, b);
+  }
+  return aRun.inputs(a) == bRun.inputs(b) && aRun.outputs(a) == bRun.outputs(b);
+}
+
+static BBSignature computeSignature(const RunLog& run, uint64_t id) {
+  BBSignature signature;
+  signature.id = id;
+
+  auto inputs = [&](auto* e) { return run.inputs(*e); };
+  auto outputs = [&](auto* e) { return run.outputs(*e); };
+  auto less = [&](auto* a, auto* b) {
+    if (run.sketched()) {
+      return sketchKey(run, *a) < sketchKey(run, *b);
+    }
+    int order = compareValues(inputs(a), inputs(b));
+    return order < 0 ||
+           (order == 0 && compareValues(outputs(a), outputs(b)) < 0);
+  };
+  auto equal = [&](auto* a, auto* b) { return sameValues(run, *a, run, *b); };
+
+  auto& executions = signature.executions;
+  for (auto& execution : run.executions(id)) {
+    executions.push_back(&execution);
+  }
+  std::sort(executions.begin(), executions.end(), less);
+  executions.erase(std::unique(executions.begin(), executions.end(), equal),
+                   executions.end());
+
+  // A block logs the same number of values on every execution, in which case
+  // distinct executions cannot dominate each other and all are maximal.
+  auto sameShape = [&](auto* e) {
+    return e->numInputs == executions[0]->numInputs &&
+           e->numOutputs == executions[0]->numOutputs;
+  };
+  if (!std::all_of(executions.begin(), executions.end(), sameShape)) {
+    auto dominatedBy = [&](auto* e, auto* other) {
+      if (run.sketched()) {
+        return sketchContainedIn(run.inputSketch(*e),
+                                 run.inputSketch(*other)) &&
+               sketchContainedIn(run.outputSketch(*e),
+                                 run.outputSketch(*other));
       }
-      if (iratio >= kInputRatioCutoff && oratio >= kOutputRatioCutoff) {
-        similar++;
-        break;
+      return containedIn(inputs(e), inputs(other)) &&
+             containedIn(outputs(e), outputs(other));
+    };
+    std::vector<const BBExecution*> maximal;
+    for (auto* e : executions) {
+      if (std::none_of(executions.begin(), executions.end(), [&](auto* other) {
+            return other != e && dominatedBy(e, other);
+          })) {
+        maximal.push_back(e);
       }
     }
+    executions = std::move(maximal);
+  }
+
+  hash_code hash = hash_value(executions.size());
+  for (auto* e : executions) {
+    if (run.sketched()) {
+      auto [numInputs, inputHash, numOutputs, outputHash] = sketchKey(run, *e);
+      hash = hash_combine(hash, numInputs, inputHash, numOutputs, outputHash);
+      continue;
+    }
+    auto in = inputs(e), out = outputs(e);
+    hash = hash_combine(hash, hash_combine_range(in.begin(), in.end()),
+                        hash_combine_range(out.begin(), out.end()));
   }
-  double ratio = (double)similar / (pLogs.size() + sLogs.size());
-  return (ratio >= kBBSimilarityCutoff);
+  signature.hash = hash;
+  return signature;
 }
 
-SEBBComparator::SEBBComparator(TestCaseLoader& loader) : loader_(loader) {}
+static RunSignatures computeSignatures(const RunLog& run) {
+  RunSignatures signatures;
+  signatures.reserve(run.blocks().size());
+  for (auto id : run.blocks()) {
+    signatures.push_back(computeSignature(run, id));
+  }
+  std::sort(signatures.begin(), signatures.end(), [](auto& a, auto& b) {
+    return std::tie(a.hash, a.id) < std::tie(b.hash, b.id);
+  });
+  return signatures;
+}
 
-void SEBBComparator::compareModules(Module& p, Module& s) {
-  DenseMap<uint64_t, BasicBlock*> pBBMap, sBBMap;
+static bool sameSignature(const RunLog& pRun, const BBSignature& p,
+                          const RunLog& sRun, const BBSignature& s) {
+  return p.hash == s.hash &&
+         std::equal(p.executions.begin(), p.executions.end(),
+                    s.executions.begin(), s.executions.end(),
+                    [&](auto* pLog, auto* sLog) {
+                      return sameValues(pRun, *pLog, sRun, *sLog);
+                    });
+}
+
+// Counts every similar pair of blocks of one run into SEBB. Only blocks with
+// equal signature hashes are compared, so this is linear in the number of
+// blocks plus the number of similar pairs.
+//
+// A block of p has one signature, so the groups of blocks sharing a hash
+// write disjoint rows of SEBB. Consecutive groups are sharded over numJobs
+// threads, which need no locking, and every count ends up the same whatever
+// the number of threads.
+static void accumulateSimilarBlocks(const RunLog& pRun, const RunSignatures& p,
+                                    const RunLog& sRun, const RunSignatures& s,
+                                    SEBBMatrix& SEBB, unsigned numJobs) {
+  using Group = std::pair<ArrayRef<BBSignature>, ArrayRef<BBSignature>>;
+  std::vector<Group> groups;
+  // Groups [shards[k], shards[k + 1]) make up shard k.
+  std::vector<size_t> shards{0};
+  size_t pairs = 0;
+  auto pIter = p.begin(), sIter = s.begin();
+  while (pIter != p.end() && sIter != s.end()) {
+    if (pIter->hash < sIter->hash) {
+      ++pIter;
+    } else if (sIter->hash < pIter->hash) {
+      ++sIter;
+    } else {
+      uint64_t hash = pIter->hash;
+      auto pEnd = std::find_if(pIter, p.end(),
+                               [&](auto& sig) { return sig.hash != hash; });
+      auto sEnd = std::find_if(sIter, s.end(),
+                               [&](auto& sig) { return sig.hash != hash; });
+      groups.emplace_back(makeArrayRef(&*pIter, pEnd - pIter),
+                          makeArrayRef(&*sIter, sEnd - sIter));
+      pairs += (pEnd - pIter) * (sEnd - sIter);
+      if (pairs >= kShardPairs) {
+        shards.push_back(groups.size());
+        pairs = 0;
+      }
+      pIter = pEnd;
+      sIter = sEnd;
+    }
+  }
+  if (shards.back() != groups.size()) {
+    shards.push_back(groups.size());
+  }
+
+  parallelFor(numJobs, 0, shards.size() - 1, [&](size_t shard) {
+    for (size_t g = shards[shard]; g < shards[shard + 1]; g++) {
+      for (auto& pSig : groups[g].first) {
+        for (auto& sSig : groups[g].second) {
+          if (sameSignature(pRun, pSig, sRun, sSig)) {
+            SEBB.increment(pSig.id, sSig.id);
+          }
+        }
+      }
+    }
+  });
+}
+
+// Counts every similar pair of blocks of one run into SEBB by comparing all
+// of them. Like accumulateSimilarBlocks, shards own whole rows of SEBB.
+static void accumulateAllBlockPairs(const RunLog& pRun, const RunLog& sRun,
+                                    SEBBMatrix& SEBB,
+                                    const SEBBOptions& options) {
+  ArrayRef<uint64_t> pBlocks = pRun.blocks(), sBlocks = sRun.blocks();
+  size_t shardRows =
+      std::max<size_t>(1, kShardPairs / std::max<size_t>(1, sBlocks.size()));
+  size_t numShards = divideCeil(pBlocks.size(), shardRows);
+  parallelFor(options.numJobs, 0, numShards, [&](size_t shard) {
+    size_t end = std::min(pBlocks.size(), (shard + 1) * shardRows);
+    for (size_t i = shard * shardRows; i < end; i++) {
+      uint64_t pID = pBlocks[i];
+      for (auto sID : sBlocks) {
+        if (compareBBSimilarity(pRun, pRun.executions(pID), sRun,
+                                sRun.executions(sID), options)) {
+          SEBB.increment(pID, sID);
+        }
+      }
+    }
+  });
+}
 
-  legacy::PassManager ppm, spm;
-  ppm.add(new PlaintiffPass(pBBMap));
-  ppm.add(createVerifierPass());
-  ppm.run(p);
+// The trace buffer of a single run. Every run gets its own file, handed to the
+// runtime through kLogEnvVar, so that any number of runs can go in parallel.
+// The runtime grows the file as needed; once the run is over it is mapped
+// whole and read front to back.
+class RunBuffer {
+public:
+  RunBuffer() {
+    if (sys::fs::createTemporaryFile(kLogPrefix, "", fd_, path_)) {
+      report_fatal_error("Unable to create a trace buffer.");
+    }
+  }
+
+  ~RunBuffer() {
+    if (buffer_) {
+      munmap(buffer_, size_);
+    }
+    close(fd_);
+    sys::fs::remove(path_);
+  }
 
-  spm.add(new SuspiciousPass(sBBMap));
-  spm.add(createVerifierPass());
-  spm.run(s);
+  StringRef path() const { return path_; }
 
-  Compiler compiler;
-  compiler.Compile(p, kPlaintiffExePath);
-  compiler.Compile(s, kSuspiciousExePath);
+  ArrayRef<uint8_t> map() {
+    struct stat st;
+    if (fstat(fd_, &st) != 0 || st.st_size == 0) {
+      return {};
+    }
+    size_ = st.st_size;
+    void* buffer = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd_, 0);
+    if (buffer == MAP_FAILED) {
+      report_fatal_error("Unable to map the trace buffer " + Twine(path_));
+    }
+    madvise(buffer, size_, MADV_SEQUENTIAL);
+    buffer_ = static_cast<uint8_t*>(buffer);
+    return makeArrayRef(buffer_, size_);
+  }
+
+private:
+  int fd_ = -1;
+  SmallString<128> path_;
+  uint8_t* buffer_ = nullptr;
+  size_t size_ = 0;
+};
+
+// Runs a program on a test case with its trace written to buffer. A trace of
+// paths has no values, only the control flow.
+static int runProgram(Executor& executor, StringRef exePath,
+                      StringRef testCasePath,
+                      ArrayRef<std::string> environment, StringRef values,
+                      RunBuffer& buffer, bool tracePaths = false) {
+  std::vector<StringRef> env(environment.begin(), environment.end());
+  std::string logVar = (Twine(kLogEnvVar) + "=" + buffer.path()).str();
+  env.push_back(logVar);
+  std::string valuesVar = (Twine(kValuesEnvVar) + "=" + values).str();
+  if (!values.empty()) {
+    env.push_back(valuesVar);
+  }
+  std::string traceVar = (Twine(kTraceEnvVar) + "=paths").str();
+  if (tracePaths) {
+    env.push_back(traceVar);
+  }
+  return executor.Run(exePath, testCasePath, env);
+}
+
+SEBBComparator::SEBBComparator(TestCaseLoader& loader, Executor& executor,
+                               const SEBBOptions& options)
+    : loader_(loader), executor_(executor), options_(options),
+      values_(options.values) {
+  // With every cutoff at 1, two basic blocks are similar iff each execution
+  // of one is dominated by (has its inputs and outputs multiset-contained in)
+  // some execution of the other, and vice versa. As domination is a partial
+  // order, that holds iff both have the same set of maximal executions, which
+  // lets us match blocks by hashing that set instead of comparing all pairs.
+  exactSimilarity_ = options_.inputCutoff >= 1 && options_.outputCutoff >= 1 &&
+                     options_.blockCutoff >= 1;
+
+  std::string logVar = std::string(kLogEnvVar) + "=";
+  std::string samplingVar = std::string(kSamplingEnvVar) + "=";
+  std::string valuesVar = std::string(kValuesEnvVar) + "=";
+  std::string traceVar = std::string(kTraceEnvVar) + "=";
+  for (char** var = environ; *var; var++) {
+    if (!StringRef(*var).startswith(logVar) &&
+        !StringRef(*var).startswith(traceVar) &&
+        (options_.sampling.empty() ||
+         !StringRef(*var).startswith(samplingVar)) &&
+        ((values_.empty() && !options_.valueReport) ||
+         !StringRef(*var).startswith(valuesVar))) {
+      environment_.emplace_back(*var);
+    }
+  }
+  if (!options_.sampling.empty()) {
+    environment_.push_back(samplingVar + options_.sampling);
+  }
+  if (!options_.cacheDir.empty()) {
+    cache_ =
+        std::make_unique<BinaryCache>(options_.cacheDir, options_.cacheLimit);
+  }
+  if (!options_.traceStore.empty()) {
+    traceStore_ = std::make_unique<TraceStore>(options_.traceStore);
+  }
+}
+
+void SEBBComparator::buildModule(Module& m, StringRef exePath) {
+  std::string key;
+  std::string buildKey = executor_.GetBuildKey();
+  if (cache_ && !buildKey.empty()) {
+    std::string pass = "pass=" + std::to_string(BBLoggingPass::Version);
+    if (options_.paths) {
+      pass += ";paths";
+    }
+    key = BinaryCache::computeKey(m, pass + ";" + buildKey);
+    if (cache_->fetch(key, exePath)) {
+      return;
+    }
+    // exePath must not be written through a link into the cache.
+    sys::fs::remove(exePath);
+  }
+
+  DenseMap<uint64_t, BasicBlock*> bbMap;
+
+  legacy::PassManager pm;
+  auto* pass = new PlaintiffPass(bbMap, options_.paths);
+  pm.add(pass);
+  pm.add(createVerifierPass());
+  pm.run(m);
+  if (options_.hookReport) {
+    pass->print(errs(), &m);
+  }
+
+  // Cloned before the build, which may link the runtime in and optimize.
+  std::unique_ptr<Module> reference;
+  if (reference_) {
+    reference = CloneModule(m);
+  }
+  executor_.Build(m, exePath);
+  if (reference) {
+    std::string referencePath = (exePath + ".reference").str();
+    reference_->Build(*reference, referencePath);
+    verifyBuild(exePath, referencePath);
+  }
+  if (!key.empty()) {
+    cache_->store(key, exePath);
+  }
+}
 
-  int fd = open(kLogPath, O_RDWR | O_CREAT, 0666);
-  ftruncate(fd, kBufferSize);
-  uint64_t* buffer = static_cast<uint64_t*>(
-      mmap(nullptr, kBufferSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+void SEBBComparator::verifyBuild(StringRef exePath, StringRef referencePath) {
+  int numTestCases = loader_.GetNumTestCases();
+  std::vector<char> differs(numTestCases);
+  parallelFor(options_.numJobs, 0, numTestCases, [&](size_t id) {
+    StringRef testCasePath = loader_.GetTestCase(id);
+    RunBuffer buffer, referenceBuffer;
+    runProgram(executor_, exePath, testCasePath, environment_, values_,
+               buffer);
+    runProgram(*reference_, referencePath, testCasePath, environment_,
+               values_, referenceBuffer);
+    differs[id] = buffer.map() != referenceBuffer.map();
+  });
+
+  bool failed = false;
+  for (int id = 0; id < numTestCases; id++) {
+    if (differs[id]) {
+      errs() << exePath << " and " << referencePath
+             << " log different traces on " << loader_.GetTestCase(id)
+             << "\n";
+      failed = true;
+    }
+  }
+  if (failed) {
+    report_fatal_error("The build of " + exePath +
+                       " does not log the same traces as its reference build.");
+  }
+}
 
+std::vector<SEBBProfile>
+SEBBComparator::profileExecutables(ArrayRef<std::string> exePaths) {
   int numTestCases = loader_.GetNumTestCases();
+  std::vector<SEBBProfile> profiles(exePaths.size());
+  for (auto& profile : profiles) {
+    profile.runLogs.resize(std::max(numTestCases - 1, 0));
+    profile.runSignatures.resize(profile.runLogs.size());
+  }
 
-  DenseMap<uint64_t, DenseMap<uint64_t, double>> SEBB;
+  // Runs are looked up in the trace store by what decides what they log:
+  // the executable, the test case and the configuration of the runtime.
+  // Programs that are not executable files (with the JIT) are not stored:
+  // whatever file is at their path did not come from their module.
+  std::vector<std::string> binaryHashes(exePaths.size());
+  std::vector<std::string> testCaseHashes(numTestCases);
+  std::string config = "values=" + values_;
+  if (traceStore_ && !executor_.GetBuildKey().empty()) {
+    for (size_t i = 0; i < exePaths.size(); i++) {
+      binaryHashes[i] = hashFile(exePaths[i]);
+    }
+    for (int id = 0; id < numTestCases; id++) {
+      testCaseHashes[id] = hashFile(loader_.GetTestCase(id));
+    }
+    for (auto& var : environment_) {
+      if (StringRef(var).startswith(kRuntimeEnvPrefix)) {
+        config += ";" + var;
+      }
+    }
+  }
 
-  for (int id = 0; id < numTestCases - 1; id++) {
+  // One task per (executable, test case) pair; every task writes only to its
+  // own slot of profiles.
+  size_t numTasks = exePaths.size() * numTestCases;
+  parallelFor(options_.numJobs, 0, numTasks, [&](size_t task) {
+    StringRef exePath = exePaths[task / numTestCases];
+    SEBBProfile& profile = profiles[task / numTestCases];
+    int id = task % numTestCases;
     StringRef testCasePath = loader_.GetTestCase(id);
+    bool isLast = id == numTestCases - 1;
 
-    sys::ExecuteAndWait(kPlaintiffExePath, {kPlaintiffExePath}, None,
-                        {testCasePath, StringRef(), StringRef()});
-    RunLog plaintiffLog = readLogFromFile(buffer);
-
-    sys::ExecuteAndWait(kSuspiciousExePath, {kSuspiciousExePath}, None,
-                        {testCasePath, StringRef(), StringRef()});
-    RunLog suspiciousLog = readLogFromFile(buffer);
-
-    for (uint64_t p = 1; p <= plaintiffLog.size(); ++p) {
-      for (uint64_t s = 1; s <= suspiciousLog.size(); ++s) {
-        // if (s != p) continue;
-        auto& pLogs = plaintiffLog[p];
-        auto& sLogs = suspiciousLog[s];
-        auto t = compareBBSimilarity(pLogs, sLogs);
-        SEBB[p][s] += t;
+    std::string key;
+    StringRef binaryHash = binaryHashes[task / numTestCases];
+    if (!binaryHash.empty() && !testCaseHashes[id].empty()) {
+      key = TraceStore::computeKey(binaryHash, testCaseHashes[id], config);
+    }
+    bool stored = !key.empty() &&
+                  (isLast ? traceStore_->lookup(key, profile.cftLog)
+                          : traceStore_->lookup(key, profile.runLogs[id]));
+
+    if (!stored) {
+      RunBuffer buffer;
+      int status = runProgram(executor_, exePath, testCasePath, environment_,
+                              values_, buffer, isLast && options_.paths);
+      if (isLast) {
+        profile.cftLog = ControlFlowTraceLog::decode(buffer.map());
+      } else {
+        profile.runLogs[id] = RunLog::decode(buffer.map());
       }
+      // A run that was killed may not do the same the next time.
+      if (!key.empty() && status >= 0) {
+        if (isLast) {
+          traceStore_->store(key, profile.cftLog);
+        } else {
+          traceStore_->store(key, profile.runLogs[id]);
+        }
+      }
+    }
+
+    if (!isLast && exactSimilarity_) {
+      profile.runSignatures[id] = computeSignatures(profile.runLogs[id]);
+    }
+  });
+
+  for (auto& profile : profiles) {
+    for (auto& runLog : profile.runLogs) {
+      profile.maxBBID = std::max(profile.maxBBID, runLog.maxBBID());
+    }
+    for (auto id : profile.cftLog.pool()) {
+      profile.maxBBID = std::max(profile.maxBBID, id);
     }
   }
 
-  const double simThreshold = 0.8 * (numTestCases - 1);
+  return profiles;
+}
 
-  for (int id = numTestCases - 1; id < numTestCases; id++) {
-    StringRef testCasePath = loader_.GetTestCase(id);
+SEBBProfile SEBBComparator::profileModule(Module& m, StringRef exePath) {
+  buildModule(m, exePath);
+  return std::move(profileExecutables({exePath.str()}).front());
+}
+
+SEBBScore SEBBComparator::compareProfiles(const SEBBProfile& p,
+                                          const SEBBProfile& s) {
+  SEBBScore score;
+  score.matrixBytes = SEBBMatrix::memoryUsage(p.maxBBID, s.maxBBID);
+  if (score.matrixBytes > options_.matrixLimit) {
+    report_fatal_error("The SEBB matrix of " + Twine(p.maxBBID) + "x" +
+                       Twine(s.maxBBID) + " basic blocks needs " +
+                       Twine(score.matrixBytes >> 20) + " MiB, over the " +
+                       Twine(options_.matrixLimit >> 20) + " MiB limit.");
+  }
+  SEBBMatrix SEBB(p.maxBBID, s.maxBBID);
+
+  size_t numRuns = std::min(p.runLogs.size(), s.runLogs.size());
+  for (size_t run = 0; run < numRuns; run++) {
+    // A run that logged nothing, e.g. one that crashed before its first
+    // block, fits either mode.
+    if (p.runLogs[run].sketched() != s.runLogs[run].sketched() &&
+        !p.runLogs[run].blocks().empty() && !s.runLogs[run].blocks().empty()) {
+      report_fatal_error("Cannot compare sketched values with exact ones.");
+    }
+    if (exactSimilarity_) {
+      accumulateSimilarBlocks(p.runLogs[run], p.runSignatures[run],
+                              s.runLogs[run], s.runSignatures[run], SEBB,
+                              options_.numJobs);
+    } else {
+      accumulateAllBlockPairs(p.runLogs[run], s.runLogs[run], SEBB, options_);
+    }
+  }
 
-    sys::ExecuteAndWait(kPlaintiffExePath, {kPlaintiffExePath}, None,
-                        {testCasePath, StringRef(), StringRef()});
-    ControlFlowTraceLog plaintiffLog = readCFTLogFromFile(buffer);
+  SEBB.computeRelation(0.8 * numRuns, options_.numJobs);
 
-    sys::ExecuteAndWait(kSuspiciousExePath, {kSuspiciousExePath}, None,
-                        {testCasePath, StringRef(), StringRef()});
-    ControlFlowTraceLog suspiciousLog = readCFTLogFromFile(buffer);
+  score.pSize = p.cftLog.size();
+  score.sSize = s.cftLog.size();
+  // The smallest LCS whose similarity reaches the threshold.
+  size_t longest = std::max(score.pSize, score.sSize);
+  size_t target = std::ceil(options_.threshold * longest);
+  while (target && (double)(target - 1) / longest >= options_.threshold) {
+    target--;
+  }
+  // Traces by paths are expanded for this pair only.
+  std::vector<uint64_t> pScratch, sScratch;
+  LCSBounds lcs = computeLCSBounded(p.cftLog.ids(pScratch),
+                                    s.cftLog.ids(sScratch),
+                                    [&](uint64_t pID, uint64_t sID) {
+                                      return SEBB.related(pID, sID);
+                                    },
+                                    target, options_.numJobs);
+  score.lcs = lcs.lower;
+  score.lcsUpper = lcs.upper;
+  return score;
+}
 
-    outs() << "pSize: " << plaintiffLog.size() << "\n";
-    outs() << "sSize: " << suspiciousLog.size() << "\n";
-    outs() << "LCS:   "
-           << computeLCS(plaintiffLog, suspiciousLog,
-                         [&](uint64_t p, uint64_t s) {
-                           return SEBB[p][s] >= simThreshold;
-                         });
+// Profiles and compares the executables with exact and with sketched values,
+// to show what sketching costs in accuracy and saves in time.
+void SEBBComparator::reportValueModes(ArrayRef<std::string> exePaths) {
+  using Clock = std::chrono::steady_clock;
+  auto seconds = [](Clock::duration d) {
+    return std::chrono::duration<double>(d).count();
+  };
+
+  outs() << "values\tprofile (s)\tcompare (s)\tLCS\tsimilarity\n";
+  double similarities[2];
+  const char* modes[] = {"exact", "sketch"};
+  for (int mode = 0; mode < 2; mode++) {
+    values_ = modes[mode];
+    auto start = Clock::now();
+    auto profiles = profileExecutables(exePaths);
+    auto profiled = Clock::now();
+    SEBBScore score = compareProfiles(profiles[0], profiles[1]);
+    auto compared = Clock::now();
+    similarities[mode] = score.similarity();
+    outs() << modes[mode] << "\t" << format("%.3f", seconds(profiled - start))
+           << "\t" << format("%.3f", seconds(compared - profiled)) << "\t"
+           << score.lcs << "\t" << format("%.4f", similarities[mode]) << "\n";
+  }
+  outs() << "similarity error: "
+         << format("%.4f", similarities[1] - similarities[0]) << "\n";
+  values_ = options_.values;
+}
+
+void SEBBComparator::compareModules(Module& p, Module& s) {
+  buildModule(p, kPlaintiffExePath);
+  buildModule(s, kSuspiciousExePath);
+  std::vector<std::string> exePaths{kPlaintiffExePath, kSuspiciousExePath};
+  if (options_.valueReport) {
+    reportValueModes(exePaths);
+    return;
+  }
+  auto profiles = profileExecutables(exePaths);
+  SEBBScore score = compareProfiles(profiles[0], profiles[1]);
+
+  outs() << "pSize: " << score.pSize << "\n";
+  outs() << "sSize: " << score.sSize << "\n";
+  outs() << "LCS:   " << score.lcs;
+  if (!score.exact()) {
+    outs() << "-" << score.lcsUpper;
   }
+  outs() << "\n";
+  outs() << "SEBB matrix: " << (score.matrixBytes >> 10) << " KiB\n";
 }
-} // namespace ppa
\ No newline at end of file
+} // namespace ppa
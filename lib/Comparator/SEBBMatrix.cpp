@@ -0,0 +1,72 @@
+#include "SEBBMatrix.h"
+#include "Parallel.h"
+#include "llvm/Support/ErrorHandling.h"
+
+#include <algorithm>
+#include <cstring>
+
+using namespace llvm;
+namespace ppa {
+
+constexpr size_t kCacheLine = 64;
+// Cells thresholded by each shard of rows in computeRelation.
+constexpr size_t kShardCells = size_t(1) << 16;
+
+static size_t roundUp(size_t value, size_t multiple) {
+  return (value + multiple - 1) / multiple * multiple;
+}
+
+// Id 0 is never used, but keeping its row and column makes indexing direct.
+static size_t countStride(uint64_t numS) {
+  return roundUp(numS + 1, kCacheLine / sizeof(SEBBMatrix::Count));
+}
+
+static size_t relationStride(uint64_t numS) {
+  return roundUp((numS + 64) / 64, kCacheLine / sizeof(uint64_t));
+}
+
+template <typename T>
+static T* allocateZeroed(size_t count) {
+  size_t bytes = roundUp(count * sizeof(T), kCacheLine);
+  void* ptr = aligned_alloc(kCacheLine, bytes);
+  if (!ptr) {
+    report_bad_alloc_error("Unable to allocate the SEBB matrix");
+  }
+  std::memset(ptr, 0, bytes);
+  return static_cast<T*>(ptr);
+}
+
+size_t SEBBMatrix::memoryUsage(uint64_t numP, uint64_t numS) {
+  return (numP + 1) * (countStride(numS) * sizeof(Count) +
+                       relationStride(numS) * sizeof(uint64_t));
+}
+
+SEBBMatrix::SEBBMatrix(uint64_t numP, uint64_t numS)
+    : numP_(numP), numS_(numS), countStride_(countStride(numS)),
+      relationStride_(relationStride(numS)),
+      counts_(allocateZeroed<Count>((numP + 1) * countStride_)),
+      relation_(allocateZeroed<uint64_t>((numP + 1) * relationStride_)) {}
+
+void SEBBMatrix::computeRelation(double threshold, unsigned numJobs) {
+  // Blocks outside the matrix were never executed, so their count is zero.
+  relatedOutOfRange_ = 0 >= threshold;
+  // Rows are padded to whole cache lines, so shards of rows share none.
+  size_t shardRows = std::max<size_t>(1, kShardCells / (numS_ + 1));
+  size_t numShards = (numP_ + shardRows) / shardRows;
+  parallelFor(numJobs, 0, numShards, [&](size_t shard) {
+    uint64_t end = std::min<uint64_t>(numP_ + 1, (shard + 1) * shardRows);
+    for (uint64_t p = shard * shardRows; p < end; p++) {
+      const Count* counts = counts_.get() + p * countStride_;
+      uint64_t* bits = relation_.get() + p * relationStride_;
+      for (uint64_t s = 0; s <= numS_; s++) {
+        if (counts[s] >= threshold) {
+          bits[s / 64] |= uint64_t(1) << (s % 64);
+        } else {
+          bits[s / 64] &= ~(uint64_t(1) << (s % 64));
+        }
+      }
+    }
+  });
+}
+
+} // namespace ppa
@@ -0,0 +1,216 @@
+#include "TraceStore.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/Twine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/SHA1.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <unistd.h>
+
+#include <cstring>
+#include <memory>
+#include <type_traits>
+
+using namespace llvm;
+namespace ppa {
+
+// An entry is a header followed by its arrays, each padded to 8 bytes. The
+// header is the magic "PPAS", the store version as a uint32_t, then the flags,
+// the number of arrays and their sizes in bytes as uint64_t. Everything is in
+// the byte order and layout of the host, as the arrays are used in place.
+constexpr char kStoreMagic[4] = {'P', 'P', 'A', 'S'};
+// Bump whenever the layout of the entries or the decoding of traces changes.
+constexpr uint32_t kStoreVersion = 3;
+constexpr size_t kStoreAlignment = 8;
+
+constexpr uint64_t kSketchedFlag = 1;
+
+static const char* kRunLogExtension = ".log";
+static const char* kControlFlowTraceExtension = ".cft";
+static const char* kTemporaryPrefix = "tmp-";
+
+static_assert(std::is_trivially_copyable<BBExecution>::value &&
+                  sizeof(BBExecution) % kStoreAlignment == 0,
+              "Executions are stored as they are laid out in memory");
+static_assert(std::is_trivially_copyable<ControlFlowTraceLog::Run>::value &&
+                  sizeof(ControlFlowTraceLog::Run) % kStoreAlignment == 0,
+              "Runs are stored as they are laid out in memory");
+static_assert(std::is_trivially_copyable<ValueSketch>::value &&
+                  sizeof(ValueSketch) % kStoreAlignment == 0,
+              "Sketches are stored as they are laid out in memory");
+
+template <typename T> static ArrayRef<uint8_t> getBytes(ArrayRef<T> array) {
+  return makeArrayRef(reinterpret_cast<const uint8_t*>(array.data()),
+                      array.size() * sizeof(T));
+}
+
+template <typename T>
+static bool getArray(ArrayRef<uint8_t> bytes, ArrayRef<T>& array) {
+  if (bytes.size() % sizeof(T) != 0) {
+    return false;
+  }
+  array = makeArrayRef(reinterpret_cast<const T*>(bytes.data()),
+                       bytes.size() / sizeof(T));
+  return true;
+}
+
+// Maps the entry at path and splits it into its numArrays arrays. Returns null
+// if there is no such entry or it was not written by this version.
+static std::shared_ptr<sys::fs::mapped_file_region>
+mapEntry(StringRef path, size_t numArrays, uint64_t& flags,
+         SmallVectorImpl<ArrayRef<uint8_t>>& arrays) {
+  int fd;
+  if (sys::fs::openFileForRead(path, fd)) {
+    return nullptr;
+  }
+  sys::fs::file_status status;
+  std::error_code error = sys::fs::status(fd, status);
+  size_t size = error ? 0 : status.getSize();
+  size_t headerSize = 8 + 16 + 8 * numArrays;
+  if (size < headerSize) {
+    close(fd);
+    return nullptr;
+  }
+  auto region = std::make_shared<sys::fs::mapped_file_region>(
+      fd, sys::fs::mapped_file_region::readonly, size, 0, error);
+  close(fd);
+  if (error) {
+    return nullptr;
+  }
+
+  auto* data = reinterpret_cast<const uint8_t*>(region->const_data());
+  auto* words = reinterpret_cast<const uint64_t*>(data);
+  uint32_t version;
+  std::memcpy(&version, data + sizeof(kStoreMagic), sizeof(version));
+  if (std::memcmp(data, kStoreMagic, sizeof(kStoreMagic)) != 0 ||
+      version != kStoreVersion || words[2] != numArrays) {
+    return nullptr;
+  }
+  flags = words[1];
+
+  size_t offset = headerSize;
+  for (size_t i = 0; i < numArrays; i++) {
+    uint64_t arraySize = words[3 + i];
+    if (arraySize > size - offset) {
+      return nullptr;
+    }
+    arrays.push_back(makeArrayRef(data + offset, arraySize));
+    offset += alignTo(arraySize, kStoreAlignment);
+  }
+  return region;
+}
+
+TraceStore::TraceStore(StringRef directory) : directory_(directory) {
+  if (auto error = sys::fs::create_directories(directory_)) {
+    report_fatal_error("Unable to create the trace store " +
+                       Twine(directory_) + ": " + error.message());
+  }
+}
+
+std::string TraceStore::computeKey(StringRef binaryHash,
+                                   StringRef testCaseHash, StringRef config) {
+  std::string material =
+      (binaryHash + ";" + testCaseHash + ";" + config).str();
+  return toHex(SHA1::hash(arrayRefFromStringRef(material)));
+}
+
+std::string TraceStore::getEntryPath(StringRef key,
+                                     StringRef extension) const {
+  SmallString<128> path(directory_);
+  sys::path::append(path, key + extension);
+  return std::string(path.str());
+}
+
+bool TraceStore::lookup(StringRef key, RunLog& log) const {
+  uint64_t flags;
+  SmallVector<ArrayRef<uint8_t>, 5> arrays;
+  auto region =
+      mapEntry(getEntryPath(key, kRunLogExtension), 5, flags, arrays);
+  RunLog entry;
+  if (!region || !getArray(arrays[0], entry.values_) ||
+      !getArray(arrays[1], entry.sketches_) ||
+      !getArray(arrays[2], entry.executions_) ||
+      !getArray(arrays[3], entry.offsets_) ||
+      !getArray(arrays[4], entry.blocks_)) {
+    return false;
+  }
+  entry.sketched_ = flags & kSketchedFlag;
+  entry.storage_ = std::move(region);
+  log = std::move(entry);
+  return true;
+}
+
+bool TraceStore::lookup(StringRef key, ControlFlowTraceLog& log) const {
+  uint64_t flags;
+  SmallVector<ArrayRef<uint8_t>, 2> arrays;
+  auto region = mapEntry(getEntryPath(key, kControlFlowTraceExtension), 2,
+                         flags, arrays);
+  ControlFlowTraceLog entry;
+  if (!region || !getArray(arrays[0], entry.pool_) ||
+      !getArray(arrays[1], entry.runs_) || !entry.computeSize()) {
+    return false;
+  }
+  entry.storage_ = std::move(region);
+  log = std::move(entry);
+  return true;
+}
+
+void TraceStore::store(StringRef key, const RunLog& log) {
+  write(getEntryPath(key, kRunLogExtension),
+        log.sketched_ ? kSketchedFlag : 0,
+        {getBytes(log.values_), getBytes(log.sketches_),
+         getBytes(log.executions_), getBytes(log.offsets_),
+         getBytes(log.blocks_)});
+}
+
+void TraceStore::store(StringRef key, const ControlFlowTraceLog& log) {
+  write(getEntryPath(key, kControlFlowTraceExtension), 0,
+        {getBytes(log.pool_), getBytes(log.runs_)});
+}
+
+void TraceStore::write(StringRef entryPath, uint64_t flags,
+                       ArrayRef<ArrayRef<uint8_t>> arrays) {
+  SmallString<128> model(directory_);
+  sys::path::append(model, Twine(kTemporaryPrefix) + "%%%%%%%%%%%%");
+  int fd;
+  SmallString<128> temporaryPath;
+  if (sys::fs::createUniqueFile(model, fd, temporaryPath)) {
+    errs() << "Unable to add " << entryPath << " to the trace store.\n";
+    return;
+  }
+
+  {
+    raw_fd_ostream os(fd, /*shouldClose=*/true);
+    auto writeWord = [&](uint64_t word) {
+      os.write(reinterpret_cast<const char*>(&word), sizeof(word));
+    };
+    os.write(kStoreMagic, sizeof(kStoreMagic));
+    os.write(reinterpret_cast<const char*>(&kStoreVersion),
+             sizeof(kStoreVersion));
+    writeWord(flags);
+    writeWord(arrays.size());
+    for (auto& array : arrays) {
+      writeWord(array.size());
+    }
+    for (auto& array : arrays) {
+      os.write(reinterpret_cast<const char*>(array.data()), array.size());
+      os.write_zeros(alignTo(array.size(), kStoreAlignment) - array.size());
+    }
+    os.close();
+    if (!os.has_error()) {
+      if (!sys::fs::rename(temporaryPath, entryPath)) {
+        return;
+      }
+    } else {
+      os.clear_error();
+    }
+  }
+  errs() << "Unable to add " << entryPath << " to the trace store.\n";
+  sys::fs::remove(temporaryPath);
+}
+
+} // namespace ppa
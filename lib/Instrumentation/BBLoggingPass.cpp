@@ -1,8 +1,14 @@
 #include "llvm/ADT/DenseMap.h"
 #include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/Optional.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
 #include "llvm/IR/BasicBlock.h"
+#include "llvm/IR/CFG.h"
+#include "llvm/IR/Constants.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Instruction.h"
+#include "llvm/IR/IntrinsicInst.h"
 #include "llvm/IR/Module.h"
 #include "llvm/Transforms/Utils/ModuleUtils.h"
 
@@ -14,6 +20,19 @@ namespace ppa {
 
 char BBLoggingPass::ID = 0;
 
+void BBLoggingPass::print(raw_ostream& os, const Module* m) const {
+  os << m->getModuleIdentifier() << ": " << numHooks_ << " hooks in "
+     << numBlocks_ << " basic blocks, " << numRemovedHooks()
+     << " removed (" << numBlocks_ << " enter hooks, " << numConstants_
+     << " constants, " << numMerged_ << " values both read and produced)";
+  if (paths_) {
+    os << ", " << numPathFunctions_ << " of "
+       << numPathFunctions_ + numBlockFunctions_
+       << " functions traced by paths";
+  }
+  os << "\n";
+}
+
 /* 
 RegisterPass<BBLoggingPass> X("BBLoggingPass",
                               "Log the inputs and outputs of basic blocks");
@@ -96,6 +115,20 @@ static DenseSet<Value*> computeValuedInputs(BasicBlock& bb) {
   return inputs;
 }
 
+// What a hook would log for val, if that is known statically.
+static Optional<uint64_t> getConstantValue(Value* val) {
+  if (auto* c = dyn_cast<ConstantInt>(val)) {
+    if (c->getBitWidth() <= 64) {
+      return c->getZExtValue();
+    }
+  } else if (auto* c = dyn_cast<ConstantFP>(val)) {
+    if (c->getType()->isDoubleTy()) {
+      return c->getValueAPF().bitcastToAPInt().getZExtValue();
+    }
+  }
+  return None;
+}
+
 static DenseSet<Value*> computeOutputs(BasicBlock& bb) {
   DenseSet<Value*> outputs;
 
@@ -119,6 +152,221 @@ static DenseSet<Value*> computeOutputs(BasicBlock& bb) {
   return outputs;
 }
 
+// Functions with more acyclic paths than this are traced block by block, so
+// that path numbers stay small.
+constexpr uint64_t kMaxPaths = uint64_t(1) << 32;
+
+// The Ball-Larus numbering of the paths of a function; see BBLoggingPass.h.
+struct PathNumbering {
+  struct Edge {
+    unsigned from;
+    unsigned to;
+    uint64_t increment;
+  };
+
+  // The blocks reachable from the entry, which are nodes 1 to n.
+  std::vector<BasicBlock*> blocks;
+  DenseMap<BasicBlock*, unsigned> nodes;
+  // Edges between blocks that end a path, and which the next one starts
+  // after.
+  DenseSet<std::pair<BasicBlock*, BasicBlock*>> cuts;
+  std::vector<Edge> edges;
+  DenseMap<std::pair<unsigned, unsigned>, uint64_t> increments;
+  uint64_t numPaths = 0;
+
+  unsigned exitNode() const { return blocks.size() + 1; }
+
+  uint64_t increment(unsigned from, unsigned to) const {
+    return increments.lookup({from, to});
+  }
+};
+
+// Whether a block may run other blocks, which then exit before it does.
+static bool callsOut(BasicBlock& bb) {
+  return any_of(bb, [](Instruction& i) {
+    return isa<CallBase>(i) && !isa<IntrinsicInst>(i);
+  });
+}
+
+static Optional<PathNumbering> numberPaths(Function& f) {
+  for (auto& bb : f) {
+    auto* term = bb.getTerminator();
+    if (!isa<BranchInst>(term) && !isa<SwitchInst>(term) &&
+        !isa<ReturnInst>(term) && !isa<UnreachableInst>(term)) {
+      return None;
+    }
+  }
+
+  // Find the blocks and the back edges with a depth-first search.
+  PathNumbering numbering;
+  auto& blocks = numbering.blocks;
+  auto& nodes = numbering.nodes;
+  auto& cuts = numbering.cuts;
+  SmallPtrSet<BasicBlock*, 16> onStack;
+  std::vector<std::pair<BasicBlock*, succ_iterator>> stack;
+  auto visit = [&](BasicBlock* bb) {
+    blocks.push_back(bb);
+    nodes[bb] = blocks.size();
+    onStack.insert(bb);
+    stack.push_back({bb, succ_begin(bb)});
+  };
+  visit(&f.getEntryBlock());
+  while (!stack.empty()) {
+    auto& [bb, next] = stack.back();
+    if (next == succ_end(bb)) {
+      onStack.erase(bb);
+      stack.pop_back();
+      continue;
+    }
+    BasicBlock* succ = *next++;
+    if (onStack.count(succ)) {
+      cuts.insert({bb, succ});
+    } else if (!nodes.count(succ)) {
+      visit(succ);
+    }
+  }
+
+  // Without the cut edges the graph is acyclic. A path that ends at a cut
+  // goes on to the exit node, and the next one comes from the entry node.
+  unsigned exit = numbering.exitNode();
+  std::vector<SmallVector<unsigned, 2>> successors(exit + 1);
+  std::vector<bool> startsPath(exit + 1);
+  successors[0].push_back(1);
+  for (auto* bb : blocks) {
+    unsigned node = nodes[bb];
+    bool endsPath = succ_empty(bb);
+    SmallPtrSet<BasicBlock*, 4> seen;
+    for (auto* succ : llvm::successors(bb)) {
+      if (!seen.insert(succ).second) {
+        continue;
+      }
+      unsigned to = nodes[succ];
+      if (cuts.count({bb, succ}) || callsOut(*succ)) {
+        cuts.insert({bb, succ});
+        endsPath = true;
+        if (!startsPath[to]) {
+          startsPath[to] = true;
+          successors[0].push_back(to);
+        }
+      } else {
+        successors[node].push_back(to);
+      }
+    }
+    if (endsPath) {
+      successors[node].push_back(exit);
+    }
+  }
+
+  // Number the paths in post-order, so that the paths from every successor
+  // of a node are counted before the node.
+  std::vector<uint64_t> numPaths(exit + 1);
+  std::vector<bool> visited(exit + 1);
+  std::vector<std::pair<unsigned, unsigned>> dfs = {{0, 0}};
+  visited[0] = true;
+  while (!dfs.empty()) {
+    auto& [node, next] = dfs.back();
+    if (next < successors[node].size()) {
+      unsigned to = successors[node][next++];
+      if (!visited[to]) {
+        visited[to] = true;
+        dfs.push_back({to, 0});
+      }
+      continue;
+    }
+    if (node == exit) {
+      numPaths[node] = 1;
+    }
+    for (unsigned to : successors[node]) {
+      numbering.edges.push_back({node, to, numPaths[node]});
+      numbering.increments[{node, to}] = numPaths[node];
+      numPaths[node] += numPaths[to];
+      if (numPaths[node] > kMaxPaths) {
+        return None;
+      }
+    }
+    dfs.pop_back();
+  }
+  numbering.numPaths = numPaths[0];
+  return numbering;
+}
+
+// Has every path of f pass its number, offset by first, to pathFun when it
+// ends. The number so far is carried in a phi of every block.
+static void instrumentPaths(Function& f, const PathNumbering& numbering,
+                            uint64_t first, FunctionCallee pathFun) {
+  auto* int64Ty = Type::getInt64Ty(f.getContext());
+  unsigned exit = numbering.exitNode();
+  DenseMap<BasicBlock*, Value*> sums;
+  for (auto* bb : numbering.blocks) {
+    if (bb == &f.getEntryBlock()) {
+      sums[bb] = ConstantInt::get(int64Ty, numbering.increment(0, 1));
+      continue;
+    }
+    auto* phi = PHINode::Create(int64Ty, 2, "path", &bb->front());
+    for (auto* pred : predecessors(bb)) {
+      if (!numbering.nodes.count(pred)) {
+        phi->addIncoming(ConstantInt::get(int64Ty, 0), pred);
+      }
+    }
+    sums[bb] = phi;
+  }
+
+  auto endPath = [&](IRBuilder<>& builder, BasicBlock* bb) {
+    uint64_t increment = numbering.increment(numbering.nodes.lookup(bb), exit);
+    Value* number = builder.CreateAdd(sums[bb], builder.getInt64(first +
+                                                                 increment));
+    builder.CreateCall(pathFun, {number});
+  };
+  for (auto* bb : numbering.blocks) {
+    unsigned node = numbering.nodes.lookup(bb);
+    auto* term = bb->getTerminator();
+    if (isa<ReturnInst>(term)) {
+      IRBuilder<> builder(term);
+      endPath(builder, bb);
+      continue;
+    }
+    SmallVector<BasicBlock*, 4> succs;
+    for (auto* succ : successors(bb)) {
+      if (!is_contained(succs, succ)) {
+        succs.push_back(succ);
+      }
+    }
+    for (auto* succ : succs) {
+      auto* sum = cast<PHINode>(sums[succ]);
+      if (!numbering.cuts.count({bb, succ})) {
+        IRBuilder<> builder(term);
+        uint64_t increment =
+            numbering.increment(node, numbering.nodes.lookup(succ));
+        Value* value = builder.CreateAdd(sums[bb], builder.getInt64(increment));
+        for (auto* target : successors(bb)) {
+          if (target == succ) {
+            sum->addIncoming(value, bb);
+          }
+        }
+        continue;
+      }
+      // Split the edge to end the path on it.
+      auto* cut = BasicBlock::Create(f.getContext(), "", &f, succ);
+      IRBuilder<> builder(cut);
+      endPath(builder, bb);
+      builder.CreateBr(succ);
+      for (unsigned i = 0; i < term->getNumSuccessors(); i++) {
+        if (term->getSuccessor(i) == succ) {
+          term->setSuccessor(i, cut);
+        }
+      }
+      succ->replacePhiUsesWith(bb, cut);
+      for (auto& phi : succ->phis()) {
+        while (count(phi.blocks(), cut) > 1) {
+          phi.removeIncomingValue(cut, false);
+        }
+      }
+      uint64_t increment = numbering.increment(0, numbering.nodes.lookup(succ));
+      sum->addIncoming(ConstantInt::get(int64Ty, increment), cut);
+    }
+  }
+}
+
 bool ppa::BBLoggingPass::runOnModule(Module& m) {
   auto& context = m.getContext();
 
@@ -138,7 +386,6 @@ bool ppa::BBLoggingPass::runOnModule(Module& m) {
   auto* int64Ty = Type::getInt64Ty(context);
 
   auto* helperTy = FunctionType::get(voidTy, int64Ty, false);
-  auto enterFun = m.getOrInsertFunction("SEBB_RUNTIME_enter", helperTy);
   auto exitFun = m.getOrInsertFunction("SEBB_RUNTIME_exit", helperTy);
 
   auto initFun = m.getOrInsertFunction("SEBB_RUNTIME_init", voidTy);
@@ -147,37 +394,129 @@ bool ppa::BBLoggingPass::runOnModule(Module& m) {
   auto* logTy = FunctionType::get(voidTy, {int64Ty, int64Ty}, false);
   auto logInputFun = m.getOrInsertFunction("SEBB_RUNTIME_logInput", logTy);
   auto logOutputFun = m.getOrInsertFunction("SEBB_RUNTIME_logOutput", logTy);
+  auto logInputOutputFun =
+      m.getOrInsertFunction("SEBB_RUNTIME_logInputOutput", logTy);
+
+  // Lets the runtime keep per-block state, e.g. for sampling.
+  new GlobalVariable(m, int64Ty, true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(int64Ty, idMap.size()),
+                     "SEBB_RUNTIME_numBBs");
+
+  // Numbered before any hook is inserted, as calls to hooks start no path.
+  FunctionCallee exitOnPathFun, pathFun;
+  DenseMap<Function*, PathNumbering> numberings;
+  if (paths_) {
+    exitOnPathFun = m.getOrInsertFunction("SEBB_RUNTIME_exitOnPath", helperTy);
+    pathFun = m.getOrInsertFunction("SEBB_RUNTIME_path", helperTy);
+    for (auto& f : m) {
+      if (f.isDeclaration()) {
+        continue;
+      }
+      if (auto numbering = numberPaths(f)) {
+        numberings[&f] = std::move(*numbering);
+        numPathFunctions_++;
+      } else {
+        numBlockFunctions_++;
+      }
+    }
+  }
 
   appendToGlobalCtors(m, llvm::cast<Function>(initFun.getCallee()), 0);
   appendToGlobalDtors(m, llvm::cast<Function>(finalizeFun.getCallee()), 0);
 
+  // Entering a block is not part of the trace, so blocks only log their
+  // values and exit. Values known statically go into a table that the
+  // runtime writes once, and values both read and produced by a block are
+  // logged once.
+  std::vector<uint64_t> constants;
   for (auto& f : m) {
+    bool onPaths = numberings.count(&f);
     for (auto& bb : f) {
       uint64_t ID = idMap[&bb];
+      DenseSet<Value*> inputs = computeValuedInputs(bb);
+      DenseSet<Value*> outputs = computeOutputs(bb);
 
       // FIXME: This is probably not exhaustive
       IRBuilder<> builder(bb.getTerminator());
 
       auto* IDVal = builder.getInt64(ID);
-      for (auto* val : computeValuedInputs(bb)) {
+      auto log = [&](FunctionCallee hook, Value* val) {
         auto zext = builder.CreateZExtOrBitCast(val, int64Ty);
-        builder.CreateCall(logInputFun, {IDVal, zext});
+        builder.CreateCall(hook, {IDVal, zext});
+        numHooks_++;
+      };
+      auto addConstant = [&](bool isOutput, uint64_t value) {
+        constants.insert(constants.end(), {ID, isOutput, value});
+        numConstants_++;
+      };
+      for (auto* val : inputs) {
+        if (auto value = getConstantValue(val)) {
+          addConstant(false, *value);
+        } else if (outputs.erase(val)) {
+          log(logInputOutputFun, val);
+          numMerged_++;
+        } else {
+          log(logInputFun, val);
+        }
       }
-      for (auto* val : computeOutputs(bb)) {
-        auto zext = builder.CreateZExtOrBitCast(val, int64Ty);
-        builder.CreateCall(logOutputFun, {IDVal, zext});
+      for (auto* val : outputs) {
+        if (auto value = getConstantValue(val)) {
+          addConstant(true, *value);
+        } else {
+          log(logOutputFun, val);
+        }
       }
-      builder.CreateCall(exitFun.getCallee(), {IDVal});
+      builder.CreateCall(onPaths ? exitOnPathFun : exitFun, {IDVal});
+      numHooks_++;
+      numBlocks_++;
+    }
+  }
 
-      if (bb.getFirstInsertionPt() != bb.end()) {
-        builder.SetInsertPoint(&*bb.getFirstInsertionPt());
-      } else {
-        // FIXME: What if bb is empty?
-        errs() << "Basic block is empty.\n";
-      }
-      builder.CreateCall(enterFun.getCallee(), IDVal);
+  auto* int64PtrTy = Type::getInt64PtrTy(context);
+  auto* table = new GlobalVariable(
+      m, ArrayType::get(int64Ty, constants.size()), true,
+      GlobalValue::PrivateLinkage, ConstantDataArray::get(context, constants),
+      "SEBB_RUNTIME_constantTable");
+  new GlobalVariable(m, int64PtrTy, true, GlobalValue::ExternalLinkage,
+                     ConstantExpr::getPointerCast(table, int64PtrTy),
+                     "SEBB_RUNTIME_constants");
+  new GlobalVariable(m, int64Ty, true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(int64Ty, constants.size() / 3),
+                     "SEBB_RUNTIME_numConstants");
+
+  if (!paths_) {
+    return true;
+  }
+  std::vector<uint64_t> pathWords;
+  uint64_t numPaths = 0;
+  for (auto& f : m) {
+    auto numbering = numberings.find(&f);
+    if (numbering == numberings.end()) {
+      continue;
+    }
+    auto& blocks = numbering->second.blocks;
+    auto& edges = numbering->second.edges;
+    instrumentPaths(f, numbering->second, numPaths, pathFun);
+    pathWords.insert(pathWords.end(), {numPaths, blocks.size()});
+    for (auto* bb : blocks) {
+      pathWords.push_back(idMap[bb]);
+    }
+    pathWords.push_back(edges.size());
+    for (auto& edge : edges) {
+      pathWords.insert(pathWords.end(), {edge.from, edge.to, edge.increment});
     }
+    numPaths += numbering->second.numPaths;
   }
+  auto* pathTable = new GlobalVariable(
+      m, ArrayType::get(int64Ty, pathWords.size()), true,
+      GlobalValue::PrivateLinkage, ConstantDataArray::get(context, pathWords),
+      "SEBB_RUNTIME_pathTable");
+  new GlobalVariable(m, int64PtrTy, true, GlobalValue::ExternalLinkage,
+                     ConstantExpr::getPointerCast(pathTable, int64PtrTy),
+                     "SEBB_RUNTIME_paths");
+  new GlobalVariable(m, int64Ty, true, GlobalValue::ExternalLinkage,
+                     ConstantInt::get(int64Ty, pathWords.size()),
+                     "SEBB_RUNTIME_numPathWords");
 
   return true;
 }
\ No newline at end of file
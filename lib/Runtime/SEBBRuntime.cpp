@@ -1,82 +1,451 @@
+#include "ForkServer.h"
+#include "TraceFormat.h"
+
 #include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <cstring>
 #include <fcntl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/wait.h>
 #include <unistd.h>
 
+using namespace ppa;
+
 extern "C" {
 
 #define SEBB(X) SEBB_RUNTIME_##X
 
-// extern uint64_t SEBB(numBBs);
+// Emitted by the instrumentation; weak so that the runtime still links into
+// programs instrumented without it, which then log every execution.
+__attribute__((weak)) uint64_t SEBB(numBBs) = 0;
+// The values known when the program was instrumented, as numConstants
+// triples of a block id, 0 for an input or 1 for an output, and the value.
+__attribute__((weak)) const uint64_t* SEBB(constants) = nullptr;
+__attribute__((weak)) uint64_t SEBB(numConstants) = 0;
+// The numbering of the paths of the functions traced by paths, as
+// numPathWords words (see BBLoggingPass.h).
+__attribute__((weak)) const uint64_t* SEBB(paths) = nullptr;
+__attribute__((weak)) uint64_t SEBB(numPathWords) = 0;
 
 static const char* kLogPath = "/tmp/ppa_detector_log";
+// Lets the detector give every run its own trace buffer.
+static const char* kLogEnvVar = "PPA_DETECTOR_LOG";
+
+// The trace file grows one window at a time and only the window being
+// written is mapped, so runs of any length fit. Each window starts at the
+// page holding the end of the previous one, so events never straddle two
+// windows and the stream stays contiguous.
+constexpr uint64_t kSegmentSize = 4 * 1024 * 1024;
+
+// Chooses which executions of each block log their values, so that hot loops
+// cannot flood the trace with duplicates:
+//   all          every execution (the default)
+//   cap:N        the first N executions
+//   geometric    executions 1, 2, 4, 8, ...
+//   every:N[:W]  the first W executions, then one in N
+// The first execution of a block is always logged.
+static const char* kSamplingEnvVar = "PPA_DETECTOR_SAMPLING";
+
+enum SamplingPolicy { kSampleAll, kSampleCap, kSampleGeometric, kSampleEvery };
+
+static SamplingPolicy policy = kSampleAll;
+static uint64_t sampleLimit = 0;
+static uint64_t sampleWarmup = 0;
+// Number of times each block exited so far.
+static uint64_t* counters = nullptr;
+// Whether the block whose values are being logged is sampled; the values of
+// a block are logged back to back right before it exits.
+static bool decided = false;
+static bool sampled = true;
+
+// How the values of a logged execution are written:
+//   exact   every value (the default)
+//   sketch  a fixed-size sketch of the inputs and one of the outputs
+static const char* kValuesEnvVar = "PPA_DETECTOR_VALUES";
+
+static bool sketchValues = false;
+// The sketches of the block whose values are being logged, and its first
+// values, which are written instead if there are few.
+static ValueSketch inputSketch;
+static ValueSketch outputSketch;
+static uint64_t firstInputs[kSketchSize];
+static uint64_t firstOutputs[kSketchSize];
+
+// What the trace records:
+//   blocks  the values and the exit of every block (the default)
+//   paths   the paths of the functions traced by paths and the exits of the
+//           other blocks, but no values; enough for the control flow trace
+static const char* kTraceEnvVar = "PPA_DETECTOR_TRACE";
 
-constexpr uint32_t kBufferSize = 4 * 1024 * 1024;
-constexpr uint64_t kLogDelimiter = 0xFFFFFFFFFFFFFFFF;
-constexpr uint64_t kEnterBasicBlock = 0xFFFFFFFFFFFFFFFE;
-constexpr uint64_t kExitBasicBlock = 0xFFFFFFFFFFFFFFFD;
-constexpr uint64_t kInputMarker = 0x0000000000000000;
-constexpr uint64_t kOutputMarker = 0x4000000000000000;
+static bool tracePaths = false;
+static uint64_t lastPath = 0;
+// Whether the next path may be counted as a repeat of lastPath, and how many
+// repeats are yet to be written.
+static bool pathRepeatable = false;
+static uint64_t pathRepeats = 0;
 
-static uint64_t* SEBB(buffer) = nullptr;
+static uint8_t* SEBB(buffer) = nullptr;
 static int fd = 0;
-static uint32_t pos = 0;
+static uint64_t pageMask = 0;
+// The window is the file at [base, base + kSegmentSize).
+static uint64_t base = 0;
+static uint64_t pos = 0;
+static uint64_t lastExit = 0;
+
+static void mapSegment(uint64_t offset) {
+  if (SEBB(buffer)) {
+    munmap(SEBB(buffer), kSegmentSize);
+  }
+  uint64_t newBase = offset & pageMask;
+  if (ftruncate(fd, newBase + kSegmentSize) != 0) {
+    perror("SEBB runtime: unable to grow the trace file");
+    abort();
+  }
+  void* buffer = mmap(nullptr, kSegmentSize, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, fd, newBase);
+  if (buffer == MAP_FAILED) {
+    perror("SEBB runtime: unable to map the trace file");
+    abort();
+  }
+  SEBB(buffer) = static_cast<uint8_t*>(buffer);
+  base = newBase;
+  pos = offset - newBase;
+}
+
+static inline void reserveEvent(size_t size = kTraceMaxEventSize) {
+  if (__builtin_expect(pos > kSegmentSize - size, 0)) {
+    mapSegment(base + pos);
+  }
+}
+
+static inline void dumpToLogBuffer(TraceEventKind kind, uint64_t payload) {
+  reserveEvent();
+  pos = encodeTraceEvent(SEBB(buffer) + pos, kind, payload) - SEBB(buffer);
+}
+
+static inline void writeExtension(TraceExtension extension,
+                                  uint64_t operand) {
+  reserveEvent();
+  uint8_t* out = encodeTraceEvent(SEBB(buffer) + pos, kTraceExtension,
+                                  extension);
+  pos = encodeTraceVarint(out, operand) - SEBB(buffer);
+}
+
+static inline void flushPathRepeats() {
+  if (pathRepeats) {
+    writeExtension(kTracePathRepeat, pathRepeats);
+    pathRepeats = 0;
+  }
+}
+
+static void parseSamplingPolicy(const char* spec) {
+  char* end = nullptr;
+  if (strcmp(spec, "all") == 0) {
+    policy = kSampleAll;
+    return;
+  } else if (strcmp(spec, "geometric") == 0) {
+    policy = kSampleGeometric;
+    return;
+  } else if (strncmp(spec, "cap:", 4) == 0) {
+    policy = kSampleCap;
+    sampleLimit = strtoull(spec + 4, &end, 10);
+  } else if (strncmp(spec, "every:", 6) == 0) {
+    policy = kSampleEvery;
+    sampleLimit = strtoull(spec + 6, &end, 10);
+    if (*end == ':') {
+      sampleWarmup = strtoull(end + 1, &end, 10);
+    }
+  }
+  if (!end || *end != '\0' || sampleLimit == 0) {
+    fprintf(stderr, "SEBB runtime: invalid sampling policy '%s'\n", spec);
+    abort();
+  }
+}
+
+// Whether to log the execution of a block that already exited n times.
+static inline bool sampleExecution(uint64_t n) {
+  switch (policy) {
+  case kSampleAll:
+    return true;
+  case kSampleCap:
+    return n < sampleLimit;
+  case kSampleGeometric:
+    return (n & (n + 1)) == 0;
+  case kSampleEvery:
+    return n < sampleWarmup || (n - sampleWarmup) % sampleLimit == 0;
+  }
+  return true;
+}
+
+static inline bool isSampled(uint64_t id) {
+  if (!decided) {
+    sampled = !counters || id > SEBB(numBBs) || sampleExecution(counters[id]);
+    decided = true;
+  }
+  return sampled;
+}
+
+static bool readAll(int fd, void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size) {
+    ssize_t count = read(fd, bytes, size);
+    if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
 
-static inline uint64_t im(uint64_t val) { return val | kInputMarker; }
+// Serves fork requests from the detector (see ForkServer.h) until it goes
+// away, and returns only in the children, which then run as usual. Nothing
+// has been opened or mapped yet, so every child starts with a fresh trace.
+static void runForkServer() {
+  uint32_t hello = 0;
+  if (write(kForkServerStatusFd, &hello, sizeof(hello)) != sizeof(hello)) {
+    // Not started by the detector after all.
+    return;
+  }
+  for (;;) {
+    uint32_t size;
+    if (!readAll(kForkServerControlFd, &size, sizeof(size))) {
+      _exit(0);
+    }
+    char* request = static_cast<char*>(malloc(size + 1));
+    if (!request || !readAll(kForkServerControlFd, request, size)) {
+      _exit(1);
+    }
+    request[size] = '\0';
 
-static inline uint64_t om(uint64_t val) { return val | kOutputMarker; }
+    pid_t pid = fork();
+    if (pid == 0) {
+      close(kForkServerControlFd);
+      close(kForkServerStatusFd);
+      int input = open(request, O_RDONLY);
+      if (input < 0 || dup2(input, STDIN_FILENO) < 0) {
+        perror("SEBB runtime: unable to open the test case");
+        _exit(127);
+      }
+      close(input);
+      // The request outlives the child, as putenv requires.
+      clearenv();
+      for (char* var = request + strlen(request) + 1; var < request + size;
+           var += strlen(var) + 1) {
+        putenv(var);
+      }
+      return;
+    }
+    free(request);
 
-static inline void dumpToLogBuffer(uint64_t op, uint64_t val) {
-  SEBB(buffer)[pos++] = op;
-  SEBB(buffer)[pos++] = val;
+    int32_t status = -1;
+    if (pid > 0 && waitpid(pid, &status, 0) < 0) {
+      status = -1;
+    }
+    if (write(kForkServerStatusFd, &status, sizeof(status)) !=
+        sizeof(status)) {
+      _exit(1);
+    }
+  }
 }
 
 void SEBB(init)() {
-  fd = open(kLogPath, O_RDWR | O_CREAT, 0666);
-  SEBB(buffer) = static_cast<uint64_t*>(
-      mmap(nullptr, kBufferSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  if (getenv(kForkServerEnvVar)) {
+    runForkServer();
+  }
+  const char* logPath = getenv(kLogEnvVar);
+  fd = open(logPath ? logPath : kLogPath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    perror("SEBB runtime: unable to open the trace file");
+    abort();
+  }
+  const char* samplingPolicy = getenv(kSamplingEnvVar);
+  if (samplingPolicy) {
+    parseSamplingPolicy(samplingPolicy);
+  }
+  const char* values = getenv(kValuesEnvVar);
+  if (values && strcmp(values, "sketch") == 0) {
+    sketchValues = true;
+  } else if (values && strcmp(values, "exact") != 0) {
+    fprintf(stderr, "SEBB runtime: invalid value mode '%s'\n", values);
+    abort();
+  }
+  const char* trace = getenv(kTraceEnvVar);
+  if (trace && strcmp(trace, "paths") == 0) {
+    tracePaths = true;
+    // No execution is sampled, so that the value hooks return right away.
+    decided = true;
+    sampled = false;
+  } else if (trace && strcmp(trace, "blocks") != 0) {
+    fprintf(stderr, "SEBB runtime: invalid trace mode '%s'\n", trace);
+    abort();
+  }
+  if (policy != kSampleAll && SEBB(numBBs) && !tracePaths) {
+    counters = static_cast<uint64_t*>(calloc(SEBB(numBBs) + 1, 8));
+  }
+  pageMask = ~(uint64_t(sysconf(_SC_PAGESIZE)) - 1);
+  mapSegment(0);
+  pos = writeTraceHeader(SEBB(buffer)) - SEBB(buffer);
+  if (tracePaths) {
+    writeExtension(kTracePathTable, SEBB(numPathWords));
+    for (uint64_t i = 0; i < SEBB(numPathWords); i++) {
+      reserveEvent();
+      pos = encodeTraceVarint(SEBB(buffer) + pos, SEBB(paths)[i]) -
+            SEBB(buffer);
+    }
+  } else {
+    for (uint64_t i = 0; i < SEBB(numConstants); i++) {
+      const uint64_t* constant = SEBB(constants) + 3 * i;
+      reserveEvent(kTraceMaxConstantSize);
+      uint8_t* out = SEBB(buffer) + pos;
+      out = encodeTraceEvent(out, kTraceExtension,
+                             constant[1] ? kTraceConstantOutput
+                                         : kTraceConstantInput);
+      out = encodeTraceVarint(out, constant[0]);
+      pos = encodeTraceVarint(out, constant[2]) - SEBB(buffer);
+    }
+  }
 #ifdef VERBOSELOGGING
   printf("Running\n");
 #endif
 }
 
 void SEBB(finalize)() {
-  SEBB(buffer)[pos] = kLogDelimiter;
-  msync(SEBB(buffer), kBufferSize, MS_SYNC);
-  munmap(SEBB(buffer), kBufferSize);
+  // Finalizing twice, e.g. from an exit handler and from the destructors of
+  // a program run in-process, is harmless.
+  if (!SEBB(buffer)) {
+    return;
+  }
+  flushPathRepeats();
+  dumpToLogBuffer(kTraceExtension, kTraceEnd);
+  munmap(SEBB(buffer), kSegmentSize);
+  SEBB(buffer) = nullptr;
+  // Drop the unused tail of the last window; the shared mapping is already
+  // visible to the reader through the page cache, so no msync is needed.
+  ftruncate(fd, base + pos);
   close(fd);
 #ifdef VERBOSELOGGING
   printf("Exiting\n");
 #endif
 }
 
+// Entering a block is implied by the trace format, so nothing is written.
 void SEBB(enter)(uint64_t id) {
-  dumpToLogBuffer(kEnterBasicBlock, id);
 #ifdef VERBOSELOGGING
   printf("Entering basic block #%lu\n", id);
 #endif
 }
 
 void SEBB(exit)(uint64_t id) {
-  dumpToLogBuffer(kExitBasicBlock, id);
+  uint64_t delta = zigzagEncode(int64_t(id - lastExit));
+  lastExit = id;
+  if (tracePaths) {
+    flushPathRepeats();
+    pathRepeatable = false;
+    dumpToLogBuffer(kTraceExit, delta);
+    return;
+  }
+  if (isSampled(id)) {
+    if (sketchValues) {
+      reserveEvent(kTraceMaxEventSize + kTraceMaxSketchSize);
+      uint8_t* out = SEBB(buffer) + pos;
+      out = encodeTraceEvent(out, kTraceExtension, kTraceSketch);
+      out = encodeValueSketch(out, inputSketch, firstInputs);
+      pos = encodeValueSketch(out, outputSketch, firstOutputs) - SEBB(buffer);
+      inputSketch = ValueSketch();
+      outputSketch = ValueSketch();
+    }
+    dumpToLogBuffer(kTraceExit, delta);
+  } else {
+    writeExtension(kTraceSkippedExit, delta);
+  }
+  decided = false;
+  if (counters && id <= SEBB(numBBs)) {
+    counters[id]++;
+  }
 #ifdef VERBOSELOGGING
   printf("Exiting basic block #%lu\n", id);
 #endif
 }
 
+// The exit of a block of a function traced by paths, which the path it is
+// on stands for.
+void SEBB(exitOnPath)(uint64_t id) {
+  if (!tracePaths) {
+    SEBB(exit)(id);
+  }
+}
+
+void SEBB(path)(uint64_t path) {
+  if (!tracePaths) {
+    return;
+  }
+  // A loop that takes the same path over and over only counts it.
+  if (path == lastPath && pathRepeatable) {
+    pathRepeats++;
+    return;
+  }
+  flushPathRepeats();
+  writeExtension(kTracePath, zigzagEncode(int64_t(path - lastPath)));
+  lastPath = path;
+  pathRepeatable = true;
+}
+
 void SEBB(logInput)(uint64_t id, uint64_t val) {
-  dumpToLogBuffer(im(id), val);
+  if (!isSampled(id)) {
+    return;
+  }
+  if (sketchValues) {
+    if (inputSketch.size < kSketchSize) {
+      firstInputs[inputSketch.size] = val;
+    }
+    inputSketch.add(val);
+    return;
+  }
+  // The value belongs to the next exit, so the id need not be written.
+  dumpToLogBuffer(kTraceInput, val);
 #ifdef VERBOSELOGGING
   printf("Basic block %lu has a new input of value %lu\n", id, val);
 #endif
 }
 
 void SEBB(logOutput)(uint64_t id, uint64_t val) {
-  dumpToLogBuffer(om(id), val);
+  if (!isSampled(id)) {
+    return;
+  }
+  if (sketchValues) {
+    if (outputSketch.size < kSketchSize) {
+      firstOutputs[outputSketch.size] = val;
+    }
+    outputSketch.add(val);
+    return;
+  }
+  dumpToLogBuffer(kTraceOutput, val);
 #ifdef VERBOSELOGGING
   printf("Basic block %lu has a new output of value %lu\n", id, val);
 #endif
 }
-}
\ No newline at end of file
+
+void SEBB(logInputOutput)(uint64_t id, uint64_t val) {
+  if (!isSampled(id)) {
+    return;
+  }
+  if (sketchValues) {
+    if (inputSketch.size < kSketchSize) {
+      firstInputs[inputSketch.size] = val;
+    }
+    inputSketch.add(val);
+    if (outputSketch.size < kSketchSize) {
+      firstOutputs[outputSketch.size] = val;
+    }
+    outputSketch.add(val);
+    return;
+  }
+  writeExtension(kTraceInputOutput, val);
+#ifdef VERBOSELOGGING
+  printf("Basic block %lu has a new input and output of value %lu\n", id, val);
+#endif
+}
+}
@@ -0,0 +1,216 @@
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include "LCS.h"
+#include "Parallel.h"
+
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <vector>
+
+using namespace llvm;
+
+// Times the LCS of two synthetic traces with the serial bit-parallel algorithm
+// and with the wavefront one on 1, 2, 4, ... threads. With -verify, checks
+// every LCS kernel against the reference DP instead.
+
+static cl::OptionCategory lcsBenchCategory{"lcs-bench options"};
+
+static cl::opt<unsigned> length{"length", cl::desc{"Length of both traces"},
+                                cl::value_desc{"N"}, cl::init(1000000),
+                                cl::cat{lcsBenchCategory}};
+
+static cl::opt<unsigned> alphabet{
+    "alphabet", cl::desc{"Number of distinct basic blocks in the traces"},
+    cl::value_desc{"N"}, cl::init(256), cl::cat{lcsBenchCategory}};
+
+static cl::opt<double> mutation{
+    "mutation",
+    cl::desc{"Probability that the second trace substitutes, drops or "
+             "inserts a block at each position of the first"},
+    cl::value_desc{"P"}, cl::init(0.1), cl::cat{lcsBenchCategory}};
+
+static cl::opt<unsigned> maxJobs{
+    "max-jobs",
+    cl::desc{"Largest number of threads to time (0: one per hardware thread)"},
+    cl::value_desc{"N"}, cl::init(0), cl::cat{lcsBenchCategory}};
+
+static cl::opt<unsigned> verify{
+    "verify",
+    cl::desc{"Instead of timing, check every LCS kernel against the "
+             "reference DP on N random pairs of traces"},
+    cl::value_desc{"N"}, cl::init(0), cl::cat{lcsBenchCategory}};
+
+static cl::opt<unsigned> verifyLength{
+    "verify-length",
+    cl::desc{"Longest trace to check with -verify; the other trace of a pair "
+             "is at most an eighth as long"},
+    cl::value_desc{"N"}, cl::init(40000), cl::cat{lcsBenchCategory}};
+
+static cl::opt<unsigned> seed{"seed", cl::desc{"Seed of the traces"},
+                              cl::init(1), cl::cat{lcsBenchCategory}};
+
+template <typename Fn> static double timeSeconds(Fn fn) {
+  auto start = std::chrono::steady_clock::now();
+  fn();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// A copy of trace where every position is substituted, dropped or followed
+// by an inserted block with a total probability of mutation.
+static std::vector<uint64_t> mutate(const std::vector<uint64_t>& trace,
+                                    std::mt19937_64& random) {
+  std::uniform_int_distribution<uint64_t> block(0, alphabet - 1);
+  std::uniform_real_distribution<double> chance(0, 1);
+  std::vector<uint64_t> mutated;
+  mutated.reserve(trace.size());
+  for (auto bb : trace) {
+    double roll = chance(random);
+    if (roll >= mutation) {
+      mutated.push_back(bb);
+    } else if (roll < mutation / 3) {
+      mutated.push_back(block(random));
+    } else if (roll >= 2 * mutation / 3) {
+      mutated.push_back(bb);
+      mutated.push_back(block(random));
+    }
+  }
+  return mutated;
+}
+
+// A length drawn log-uniformly from [0, max], so that short traces and their
+// corner cases are checked as often as long ones.
+static size_t drawLength(size_t max, std::mt19937_64& random) {
+  std::uniform_real_distribution<double> exponent(0, std::log(max + 1.0));
+  return std::min<size_t>(std::exp(exponent(random)) - 1, max);
+}
+
+// Checks computeLCS and the kernels behind it against computeLCSNaive. The
+// traces are made of loops, small bodies repeated back to back, which is
+// what the compression looks for, and half of the pairs are compared under
+// a random relation that is not an equivalence.
+static int verifyKernels() {
+  std::mt19937_64 random(seed);
+  std::uniform_int_distribution<uint64_t> block(0, alphabet - 1);
+  std::uniform_int_distribution<size_t> bodyLength(1, 8), repeats(1, 20);
+  std::uniform_real_distribution<double> chance(0, 1);
+  unsigned numJobs = ppa::resolveNumJobs(maxJobs);
+  std::vector<bool> table(size_t(alphabet) * alphabet);
+  size_t numFailures = 0;
+
+  for (unsigned n = 0; n < verify; n++) {
+    std::vector<uint64_t> p;
+    size_t pLength = drawLength(verifyLength, random);
+    while (p.size() < pLength) {
+      std::vector<uint64_t> body(bodyLength(random));
+      for (auto& bb : body) {
+        bb = block(random);
+      }
+      for (size_t k = repeats(random); k > 0 && p.size() < pLength; k--) {
+        p.insert(p.end(), body.begin(), body.end());
+      }
+    }
+    p.resize(pLength);
+    // The other trace is a window of a mutated copy, short enough for the
+    // reference DP.
+    std::vector<uint64_t> s = mutate(p, random);
+    size_t sLength = std::min(drawLength(verifyLength / 8, random), s.size());
+    size_t offset =
+        std::uniform_int_distribution<size_t>(0, s.size() - sLength)(random);
+    s = std::vector<uint64_t>(s.begin() + offset,
+                              s.begin() + offset + sLength);
+    if (chance(random) < 0.5) {
+      std::swap(p, s);
+    }
+
+    bool equivalence = chance(random) < 0.5;
+    double density = chance(random) * 0.1;
+    for (size_t i = 0; i < table.size(); i++) {
+      table[i] = i % (alphabet + 1) == 0 || chance(random) < density;
+    }
+    auto related = [&](uint64_t pBB, uint64_t sBB) {
+      return equivalence ? pBB == sBB : bool(table[pBB * alphabet + sBB]);
+    };
+
+    size_t expected = ppa::computeLCSNaive(p, s, related);
+    auto check = [&](const char* kernel, unsigned jobs, bool passed) {
+      if (!passed) {
+        errs() << "Pair " << n << " (" << p.size() << " x " << s.size()
+               << " blocks): " << kernel << " on " << jobs
+               << " threads does not match the reference LCS " << expected
+               << "\n";
+        numFailures++;
+      }
+    };
+    check("bit-parallel", 1,
+          ppa::computeLCSBitParallel(p, s, related) == expected);
+    for (unsigned jobs : {1u, numJobs}) {
+      check("wavefront", jobs,
+            ppa::computeLCSWavefront(p, s, related, jobs) == expected);
+      check("compressed", jobs,
+            ppa::computeLCSCompressed(p, s, related, jobs) == expected);
+      check("computeLCS", jobs,
+            ppa::computeLCS(p, s, related, jobs) == expected);
+      // The bounds must hold, be exact when they meet, and decide whether
+      // the LCS reaches the target.
+      for (size_t target : {size_t(0), size_t(1), expected, expected + 1,
+                            std::uniform_int_distribution<size_t>(
+                                0, std::min(p.size(), s.size()))(random)}) {
+        ppa::LCSBounds bounds =
+            ppa::computeLCSBounded(p, s, related, target, jobs);
+        check("bounded", jobs,
+              bounds.lower <= expected && expected <= bounds.upper &&
+                  (bounds.lower >= target || bounds.upper < target));
+      }
+    }
+  }
+
+  outs() << "Checked " << verify.getValue() << " pairs of traces, "
+         << numFailures << " mismatches\n";
+  return numFailures ? 1 : 0;
+}
+
+int main(int argc, char** argv) {
+  cl::HideUnrelatedOptions(lcsBenchCategory);
+  cl::ParseCommandLineOptions(argc, argv);
+  if (verify) {
+    return verifyKernels();
+  }
+
+  std::mt19937_64 random(seed);
+  std::uniform_int_distribution<uint64_t> block(0, alphabet - 1);
+  std::vector<uint64_t> p(length);
+  for (auto& bb : p) {
+    bb = block(random);
+  }
+  std::vector<uint64_t> s = mutate(p, random);
+  auto related = [](uint64_t pBB, uint64_t sBB) { return pBB == sBB; };
+
+  outs() << "Traces of " << p.size() << " x " << s.size() << " blocks\n";
+  size_t expected;
+  double serial = timeSeconds(
+      [&]() { expected = ppa::computeLCSBitParallel(p, s, related); });
+  outs() << "threads       seconds  speedup\n";
+  outs() << format("serial     %10.3f %8.2f\n", serial, 1.0);
+
+  unsigned numJobs = ppa::resolveNumJobs(maxJobs);
+  for (unsigned jobs = 1;; jobs = std::min(jobs * 2, numJobs)) {
+    size_t lcs;
+    double seconds = timeSeconds(
+        [&]() { lcs = ppa::computeLCSWavefront(p, s, related, jobs); });
+    if (lcs != expected) {
+      report_fatal_error("The wavefront LCS does not match the serial one");
+    }
+    outs() << format("%-10u %10.3f %8.2f\n", jobs, seconds, serial / seconds);
+    if (jobs == numJobs) {
+      break;
+    }
+  }
+  outs() << "LCS: " << expected << "\n";
+  return 0;
+}
@@ -1,5 +1,6 @@
 
 #include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringExtras.h"
 #include "llvm/ADT/Triple.h"
 #include "llvm/Analysis/TargetLibraryInfo.h"
 #include "llvm/AsmParser/Parser.h"
@@ -25,6 +26,7 @@
 #include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Program.h"
+#include "llvm/Support/SHA1.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/TargetRegistry.h"
@@ -32,6 +34,9 @@
 #include "llvm/Support/ToolOutputFile.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/Internalize.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
 #include "llvm/Transforms/Scalar.h"
 
 #include <memory>
@@ -42,12 +47,10 @@
 
 using namespace llvm;
 
-static const char optLevel = '0';
-
 extern cl::list<std::string> libPaths;
 extern cl::list<std::string> libraries;
 
-static void compile(Module& m, StringRef outputPath) {
+static void compile(Module& m, StringRef outputPath, unsigned optLevel) {
   std::string err;
 
   Triple triple = Triple(m.getTargetTriple());
@@ -61,16 +64,16 @@ static void compile(Module& m, StringRef outputPath) {
   default:
     report_fatal_error("Invalid optimization level.\n");
   // No fall through
-  case '0':
+  case 0:
     level = CodeGenOpt::None;
     break;
-  case '1':
+  case 1:
     level = CodeGenOpt::Less;
     break;
-  case '2':
+  case 2:
     level = CodeGenOpt::Default;
     break;
-  case '3':
+  case 3:
     level = CodeGenOpt::Aggressive;
     break;
   }
@@ -128,10 +131,10 @@ static void compile(Module& m, StringRef outputPath) {
   out->keep();
 }
 
-static void link(StringRef objectFile, StringRef outputFile) {
+static void link(StringRef objectFile, StringRef outputFile,
+                 unsigned optLevel) {
   auto clang = sys::findProgramByName("clang++");
-  std::string opt("-O");
-  opt += optLevel;
+  std::string opt = "-O" + std::to_string(optLevel);
 
   if (!clang) {
     report_fatal_error("Unable to find clang.");
@@ -165,13 +168,14 @@ static void link(StringRef objectFile, StringRef outputFile) {
   }
 }
 
-static void generateBinary(Module& m, StringRef outputFilename) {
+static void generateBinary(Module& m, StringRef outputFilename,
+                           unsigned optLevel) {
   // Compiling to native should allow things to keep working even when the
   // version of clang on the system and the version of LLVM used to compile
   // the tool don't quite match up.
   std::string objectFile = outputFilename.str() + ".o";
-  compile(m, objectFile);
-  link(objectFile, outputFilename);
+  compile(m, objectFile, optLevel);
+  link(objectFile, outputFilename, optLevel);
 }
 
 static void saveModule(Module const& m, StringRef filename) {
@@ -186,6 +190,11 @@ static void saveModule(Module const& m, StringRef filename) {
 }
 
 void prepareLinkingPaths(/* SmallString<32> invocationPath */) {
+  static bool prepared = false;
+  if (prepared) {
+    return;
+  }
+  prepared = true;
   /*
   FIXME(shiges): Should we consider the invocation directory?
   // First search the directory of the binary for the library, in case it is
@@ -212,14 +221,98 @@ void prepareLinkingPaths(/* SmallString<32> invocationPath */) {
   libraries.push_back("rt");
 }
 
-static void compileModule(Module& m, StringRef outFile) {
-  generateBinary(m, outFile);
+// The contents of the first lib<name>.a or lib<name>.so on the library path,
+// hashed.
+static std::string hashLibrary(StringRef library) {
+  for (auto& libPath : libPaths) {
+    for (auto* extension : {".a", ".so"}) {
+      SmallString<128> path(libPath);
+      sys::path::append(path, "lib" + library + extension);
+      if (auto buffer = MemoryBuffer::getFile(path)) {
+        auto contents = arrayRefFromStringRef((*buffer)->getBuffer());
+        return toHex(SHA1::hash(contents));
+      }
+    }
+  }
+  // A system library, which we assume does not change.
+  return library.str();
+}
+
+// The runtime bitcode on the library path, or the empty string.
+static std::string findRuntimeBitcode() {
+  for (auto& libPath : libPaths) {
+    SmallString<128> path(libPath);
+    sys::path::append(path, RUNTIME_BITCODE);
+    if (sys::fs::exists(path)) {
+      return std::string(path.str());
+    }
+  }
+  return "";
+}
+
+// Links the runtime hooks that m calls into it, where the optimizer can
+// inline them. Only what came from the runtime is internalized, so that the
+// program keeps the symbols other libraries may refer to.
+static void linkRuntime(Module& m, StringRef runtimePath) {
+  SMDiagnostic err;
+  std::unique_ptr<Module> runtime = parseIRFile(runtimePath, err,
+                                                m.getContext());
+  if (!runtime) {
+    err.print("ppa-detector", errs());
+    report_fatal_error("Unable to load the runtime bitcode.");
+  }
+  runtime->setTargetTriple(m.getTargetTriple());
+  runtime->setDataLayout(m.getDataLayout());
+  bool failed = Linker::linkModules(
+      m, std::move(runtime), Linker::Flags::LinkOnlyNeeded,
+      [](Module& m, const StringSet<>& linked) {
+        internalizeModule(m, [&](const GlobalValue& gv) {
+          return !gv.hasName() || !linked.count(gv.getName());
+        });
+      });
+  if (failed) {
+    report_fatal_error("Unable to link the runtime into the program.");
+  }
+}
+
+static void optimize(Module& m, unsigned optLevel) {
+  PassManagerBuilder builder;
+  builder.OptLevel = optLevel;
+  builder.Inliner = createFunctionInliningPass(optLevel, 0, false);
+
+  legacy::FunctionPassManager fpm(&m);
+  legacy::PassManager mpm;
+  TargetLibraryInfoImpl tlii(Triple(m.getTargetTriple()));
+  mpm.add(new TargetLibraryInfoWrapperPass(tlii));
+  builder.populateFunctionPassManager(fpm);
+  builder.populateModulePassManager(mpm);
+
+  fpm.doInitialization();
+  for (auto& f : m) {
+    fpm.run(f);
+  }
+  fpm.doFinalization();
+  mpm.run(m);
+}
+
+static void compileModule(Module& m, StringRef outFile, unsigned optLevel) {
+  if (optLevel > 0) {
+    std::string runtimePath = findRuntimeBitcode();
+    if (!runtimePath.empty()) {
+      linkRuntime(m, runtimePath);
+    } else {
+      errs() << "Warning: " << RUNTIME_BITCODE << " not found; the runtime "
+             << "hooks are not inlined.\n";
+    }
+    optimize(m, optLevel);
+  }
+  generateBinary(m, outFile, optLevel);
   saveModule(m, std::string(outFile) + ".ppa.bc");
 }
 
 namespace ppa {
 
-Compiler::Compiler() {
+Compiler::Compiler(unsigned optLevel) : optLevel_(optLevel) {
   prepareLinkingPaths();
   InitializeAllTargets();
   InitializeAllTargetMCs();
@@ -229,7 +322,32 @@ Compiler::Compiler() {
 }
 
 void Compiler::Compile(Module& module, StringRef outFile) {
-  compileModule(module, outFile);
+  compileModule(module, outFile, optLevel_);
+}
+
+std::string Compiler::GetBuildKey() {
+  if (!buildKey_.empty()) {
+    return buildKey_;
+  }
+  raw_string_ostream os(buildKey_);
+  auto relocModel = getRelocModel();
+  auto codeModel = getCodeModel();
+  os << "opt=" << optLevel_ << ";arch=" << MArch << ";cpu=" << MCPU
+     << ";reloc=" << (relocModel ? int(*relocModel) : -1)
+     << ";code=" << (codeModel ? int(*codeModel) : -1)
+     << ";float-abi=" << int(FloatABIForCalls.getValue());
+  for (auto& library : libraries) {
+    os << ";lib" << library << "=" << hashLibrary(library);
+  }
+  std::string runtimePath = findRuntimeBitcode();
+  if (optLevel_ > 0 && !runtimePath.empty()) {
+    if (auto buffer = MemoryBuffer::getFile(runtimePath)) {
+      auto contents = arrayRefFromStringRef((*buffer)->getBuffer());
+      os << ";" << RUNTIME_BITCODE << "=" << toHex(SHA1::hash(contents));
+    }
+  }
+  os.flush();
+  return buildKey_;
 }
 
 } // namespace ppa
@@ -0,0 +1,171 @@
+#include "ForkServerExecutor.h"
+#include "ForkServer.h"
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+
+using namespace llvm;
+
+namespace ppa {
+
+static bool readAll(int fd, void* data, size_t size) {
+  char* bytes = static_cast<char*>(data);
+  while (size) {
+    ssize_t count = read(fd, bytes, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+static bool writeAll(int fd, const void* data, size_t size) {
+  const char* bytes = static_cast<const char*>(data);
+  while (size) {
+    ssize_t count = write(fd, bytes, size);
+    if (count < 0 && errno == EINTR) {
+      continue;
+    } else if (count <= 0) {
+      return false;
+    }
+    bytes += count;
+    size -= count;
+  }
+  return true;
+}
+
+struct ForkServerExecutor::Server {
+  pid_t pid = -1;
+  int control = -1;
+  int status = -1;
+
+  ~Server() {
+    // The server exits once it reads the end of its control pipe.
+    if (control >= 0) {
+      close(control);
+    }
+    if (status >= 0) {
+      close(status);
+    }
+    if (pid > 0) {
+      waitpid(pid, nullptr, 0);
+    }
+  }
+};
+
+ForkServerExecutor::ForkServerExecutor(unsigned optLevel)
+    : NativeExecutor(optLevel) {
+  // A server that died must show up as a failed write, not kill us.
+  signal(SIGPIPE, SIG_IGN);
+}
+
+ForkServerExecutor::~ForkServerExecutor() = default;
+
+std::unique_ptr<ForkServerExecutor::Server>
+ForkServerExecutor::startServer(StringRef name, ArrayRef<StringRef> env) {
+  auto server = std::make_unique<Server>();
+  int control[2], status[2];
+  // Close-on-exec, so that servers started in parallel do not hold on to each
+  // other's pipes; dup2 clears it on the descriptors the server gets.
+  if (pipe2(control, O_CLOEXEC) != 0) {
+    return nullptr;
+  }
+  server->control = control[1];
+  if (pipe2(status, O_CLOEXEC) != 0) {
+    close(control[0]);
+    return nullptr;
+  }
+  server->status = status[0];
+
+  // Only async-signal-safe calls are allowed between fork and exec, so the
+  // arguments are prepared up front.
+  std::string path = name.str();
+  std::vector<std::string> environment(env.begin(), env.end());
+  environment.push_back(std::string(kForkServerEnvVar) + "=1");
+  std::vector<char*> envp;
+  for (auto& var : environment) {
+    envp.push_back(&var[0]);
+  }
+  envp.push_back(nullptr);
+  char* argv[] = {&path[0], nullptr};
+
+  server->pid = fork();
+  if (server->pid == 0) {
+    int null = open("/dev/null", O_RDWR);
+    if (null < 0 || dup2(control[0], kForkServerControlFd) < 0 ||
+        dup2(status[1], kForkServerStatusFd) < 0 ||
+        dup2(null, STDIN_FILENO) < 0 || dup2(null, STDOUT_FILENO) < 0 ||
+        dup2(null, STDERR_FILENO) < 0) {
+      _exit(127);
+    }
+    execve(argv[0], argv, envp.data());
+    _exit(127);
+  }
+  close(control[0]);
+  close(status[1]);
+
+  uint32_t hello;
+  if (server->pid < 0 || !readAll(server->status, &hello, sizeof(hello))) {
+    return nullptr;
+  }
+  return server;
+}
+
+int ForkServerExecutor::Run(StringRef name, StringRef inputPath,
+                            ArrayRef<StringRef> env) {
+  std::unique_ptr<Server> server;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (unsupported_.count(name)) {
+      return NativeExecutor::Run(name, inputPath, env);
+    }
+    auto& idle = idle_[name];
+    if (!idle.empty()) {
+      server = std::move(idle.back());
+      idle.pop_back();
+    }
+  }
+  if (!server) {
+    server = startServer(name, env);
+    if (!server) {
+      std::lock_guard<std::mutex> lock(mutex_);
+      unsupported_[name] = true;
+      return NativeExecutor::Run(name, inputPath, env);
+    }
+  }
+
+  std::string request = inputPath.str();
+  request.push_back('\0');
+  for (auto var : env) {
+    request.append(var.begin(), var.end());
+    request.push_back('\0');
+  }
+  uint32_t size = request.size();
+  int32_t status;
+  if (!writeAll(server->control, &size, sizeof(size)) ||
+      !writeAll(server->control, request.data(), size) ||
+      !readAll(server->status, &status, sizeof(status))) {
+    // The server died; run this one natively and start another next time.
+    return NativeExecutor::Run(name, inputPath, env);
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    idle_[name].push_back(std::move(server));
+  }
+  if (status == -1) {
+    return -1;
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -2;
+}
+
+} // namespace ppa
@@ -0,0 +1,286 @@
+#include "JITExecutor.h"
+#include "llvm/Bitcode/BitcodeReader.h"
+#include "llvm/Bitcode/BitcodeWriter.h"
+#include "llvm/ExecutionEngine/Orc/ExecutionUtils.h"
+#include "llvm/ExecutionEngine/Orc/JITTargetMachineBuilder.h"
+#include "llvm/ExecutionEngine/Orc/LLJIT.h"
+#include "llvm/IR/IRBuilder.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/DynamicLibrary.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/raw_ostream.h"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdlib>
+
+#include "config.h"
+
+extern "C" {
+void SEBB_RUNTIME_init();
+void SEBB_RUNTIME_finalize();
+void SEBB_RUNTIME_enter(uint64_t id);
+void SEBB_RUNTIME_exit(uint64_t id);
+void SEBB_RUNTIME_logInput(uint64_t id, uint64_t val);
+void SEBB_RUNTIME_logOutput(uint64_t id, uint64_t val);
+void SEBB_RUNTIME_logInputOutput(uint64_t id, uint64_t val);
+void SEBB_RUNTIME_exitOnPath(uint64_t id);
+void SEBB_RUNTIME_path(uint64_t path);
+extern uint64_t SEBB_RUNTIME_numBBs;
+extern const uint64_t* SEBB_RUNTIME_constants;
+extern uint64_t SEBB_RUNTIME_numConstants;
+extern const uint64_t* SEBB_RUNTIME_paths;
+extern uint64_t SEBB_RUNTIME_numPathWords;
+}
+
+extern void* __dso_handle;
+extern char** environ;
+
+using namespace llvm;
+
+extern cl::list<std::string> libPaths;
+extern cl::list<std::string> libraries;
+
+namespace ppa {
+
+template <typename T>
+static T check(Expected<T> value, const Twine& what) {
+  if (!value) {
+    report_fatal_error(what + ": " + toString(value.takeError()));
+  }
+  return std::move(*value);
+}
+
+static void check(Error error, const Twine& what) {
+  if (error) {
+    report_fatal_error(what + ": " + toString(std::move(error)));
+  }
+}
+
+// The libraries programs are linked against natively, loaded into the
+// detector so that the JIT finds their symbols.
+static void loadLibraries() {
+  for (auto& library : libraries) {
+    if (library == RUNTIME_LIB) {
+      continue;
+    }
+    std::string fileName = "lib" + library + ".so";
+    bool loaded = false;
+    for (auto& libPath : libPaths) {
+      std::string path = libPath + "/" + fileName;
+      if (!sys::DynamicLibrary::LoadLibraryPermanently(path.c_str())) {
+        loaded = true;
+        break;
+      }
+    }
+    if (!loaded &&
+        sys::DynamicLibrary::LoadLibraryPermanently(fileName.c_str())) {
+      errs() << "Unable to load " << fileName << " for the JIT.\n";
+    }
+  }
+}
+
+// Replaces the llvm.global_ctors or llvm.global_dtors array of m by a function
+// called name that calls its entries in the order a native build runs them:
+// constructors by ascending priority, destructors by descending priority and
+// in reverse.
+static void lowerCtorDtors(Module& m, StringRef arrayName, StringRef name) {
+  bool destructors = arrayName == "llvm.global_dtors";
+  std::vector<orc::CtorDtorIterator::Element> entries;
+  for (auto entry :
+       destructors ? orc::getDestructors(m) : orc::getConstructors(m)) {
+    entries.push_back(entry);
+  }
+  std::stable_sort(entries.begin(), entries.end(),
+                   [](const auto& a, const auto& b) {
+                     return a.Priority < b.Priority;
+                   });
+  if (destructors) {
+    std::reverse(entries.begin(), entries.end());
+  }
+
+  auto& context = m.getContext();
+  auto* fnTy = FunctionType::get(Type::getVoidTy(context), false);
+  auto* fn = Function::Create(fnTy, GlobalValue::ExternalLinkage, name, m);
+  IRBuilder<> builder(BasicBlock::Create(context, "entry", fn));
+  for (auto& entry : entries) {
+    if (entry.Func) {
+      builder.CreateCall(fnTy, entry.Func);
+    }
+  }
+  builder.CreateRetVoid();
+
+  if (auto* array = m.getNamedGlobal(arrayName)) {
+    array->eraseFromParent();
+  }
+}
+
+JITExecutor::JITExecutor() {
+  InitializeNativeTarget();
+  InitializeNativeTargetAsmPrinter();
+  loadLibraries();
+}
+
+JITExecutor::~JITExecutor() = default;
+
+void JITExecutor::Build(Module& m, StringRef name) {
+  // The JIT owns the modules it compiles along with their context, so it gets
+  // a copy of m in a context of its own.
+  SmallVector<char, 0> bitcode;
+  raw_svector_ostream os(bitcode);
+  WriteBitcodeToFile(m, os);
+  auto context = std::make_unique<LLVMContext>();
+  auto module = check(
+      parseBitcodeFile(MemoryBufferRef(os.str(), name), *context),
+      "Unable to copy the module " + name);
+  lowerCtorDtors(*module, "llvm.global_ctors", "__ppa_detector_constructors");
+  lowerCtorDtors(*module, "llvm.global_dtors", "__ppa_detector_destructors");
+
+  auto machineBuilder = check(orc::JITTargetMachineBuilder::detectHost(),
+                              "Unable to find the host target");
+  // Same as the native build at -O0, the only level main allows with the JIT.
+  machineBuilder.setCodeGenOptLevel(CodeGenOpt::None);
+  // Without a platform, the JIT neither runs constructors nor interposes
+  // atexit: the program registers its destructors with the C library of the
+  // child like a native one.
+  auto jit = check(orc::LLJITBuilder()
+                       .setJITTargetMachineBuilder(std::move(machineBuilder))
+                       .setPlatformSetUp(orc::setUpInactivePlatform)
+                       .create(),
+                   "Unable to create the JIT");
+
+  // The program logs straight into the runtime linked into the detector; all
+  // other symbols come from the libraries loaded in the process.
+  auto& dylib = jit->getMainJITDylib();
+  orc::MangleAndInterner mangle(jit->getExecutionSession(),
+                                jit->getDataLayout());
+  orc::SymbolMap runtime;
+  auto bind = [&](StringRef symbol, auto* address) {
+    runtime[mangle(symbol)] = JITEvaluatedSymbol(
+        pointerToJITTargetAddress(address), JITSymbolFlags::Exported);
+  };
+  bind("SEBB_RUNTIME_init", &SEBB_RUNTIME_init);
+  bind("SEBB_RUNTIME_finalize", &SEBB_RUNTIME_finalize);
+  bind("SEBB_RUNTIME_enter", &SEBB_RUNTIME_enter);
+  bind("SEBB_RUNTIME_exit", &SEBB_RUNTIME_exit);
+  bind("SEBB_RUNTIME_logInput", &SEBB_RUNTIME_logInput);
+  bind("SEBB_RUNTIME_logOutput", &SEBB_RUNTIME_logOutput);
+  bind("SEBB_RUNTIME_logInputOutput", &SEBB_RUNTIME_logInputOutput);
+  bind("SEBB_RUNTIME_exitOnPath", &SEBB_RUNTIME_exitOnPath);
+  bind("SEBB_RUNTIME_path", &SEBB_RUNTIME_path);
+  bind("__dso_handle", &__dso_handle);
+  check(dylib.define(orc::absoluteSymbols(std::move(runtime))),
+        "Unable to bind the SEBB runtime");
+  dylib.addGenerator(
+      check(orc::DynamicLibrarySearchGenerator::GetForCurrentProcess(
+                jit->getDataLayout().getGlobalPrefix()),
+            "Unable to search the detector for symbols"));
+
+  check(jit->addIRModule(
+            orc::ThreadSafeModule(std::move(module), std::move(context))),
+        "Unable to add the module " + name);
+
+  // Looking main and the constructors up compiles the whole program, so that
+  // children only run code and never need the JIT.
+  Program& program = programs_[name];
+  auto lookup = [&](StringRef symbol) {
+    return check(jit->lookup(symbol), "Unable to compile " + name)
+        .getAddress();
+  };
+  program.main = jitTargetAddressToFunction<int (*)(int, char**)>(
+      lookup("main"));
+  program.constructors = jitTargetAddressToFunction<void (*)()>(
+      lookup("__ppa_detector_constructors"));
+  program.destructors = jitTargetAddressToFunction<void (*)()>(
+      lookup("__ppa_detector_destructors"));
+  // What the instrumentation emitted for the runtime, if anything.
+  auto readWord = [&](StringRef symbol) -> uint64_t {
+    auto address = jit->lookup(symbol);
+    if (!address) {
+      consumeError(address.takeError());
+      return 0;
+    }
+    return *jitTargetAddressToPointer<const uint64_t*>(address->getAddress());
+  };
+  program.numBBs = readWord("SEBB_RUNTIME_numBBs");
+  program.constants =
+      reinterpret_cast<const uint64_t*>(readWord("SEBB_RUNTIME_constants"));
+  program.numConstants = readWord("SEBB_RUNTIME_numConstants");
+  program.paths =
+      reinterpret_cast<const uint64_t*>(readWord("SEBB_RUNTIME_paths"));
+  program.numPathWords = readWord("SEBB_RUNTIME_numPathWords");
+  program.jit = std::move(jit);
+}
+
+// Runs the program as if it were exec'ed: static constructors, main, and
+// then exit(), which runs its destructors (among them the one that finalizes
+// the trace) whether main returns or the program exits by itself. The parent
+// may have other threads, so the child only calls into the program and the C
+// library, never into the JIT.
+[[noreturn]] static void runChild(const JITExecutor::Program& program,
+                                  const char* inputPath, char* argv0,
+                                  char** envp) {
+  int input = open(inputPath, O_RDONLY);
+  int null = open("/dev/null", O_WRONLY);
+  if (input < 0 || null < 0 || dup2(input, STDIN_FILENO) < 0 ||
+      dup2(null, STDOUT_FILENO) < 0 || dup2(null, STDERR_FILENO) < 0) {
+    _exit(127);
+  }
+  close(input);
+  close(null);
+
+  environ = envp;
+
+  // The runtime in the detector only has weak defaults for these.
+  SEBB_RUNTIME_numBBs = program.numBBs;
+  SEBB_RUNTIME_constants = program.constants;
+  SEBB_RUNTIME_numConstants = program.numConstants;
+  SEBB_RUNTIME_paths = program.paths;
+  SEBB_RUNTIME_numPathWords = program.numPathWords;
+  // Registered first, as __libc_start_main registers the fini functions, so
+  // that they run last.
+  atexit(program.destructors);
+  program.constructors();
+
+  char* argv[] = {argv0, nullptr};
+  exit(program.main(1, argv));
+}
+
+int JITExecutor::Run(StringRef name, StringRef inputPath,
+                     ArrayRef<StringRef> env) {
+  auto iter = programs_.find(name);
+  if (iter == programs_.end()) {
+    report_fatal_error("The program " + name + " was never built.");
+  }
+
+  // Everything the child needs is set up before forking.
+  std::string input = inputPath.str();
+  std::string argv0 = name.str();
+  std::vector<std::string> environment(env.begin(), env.end());
+  std::vector<char*> envp;
+  for (auto& var : environment) {
+    envp.push_back(&var[0]);
+  }
+  envp.push_back(nullptr);
+
+  pid_t pid = fork();
+  if (pid < 0) {
+    return -1;
+  } else if (pid == 0) {
+    runChild(iter->second, input.c_str(), &argv0[0], envp.data());
+  }
+
+  int status;
+  while (waitpid(pid, &status, 0) < 0) {
+    if (errno != EINTR) {
+      return -1;
+    }
+  }
+  return WIFEXITED(status) ? WEXITSTATUS(status) : -2;
+}
+
+} // namespace ppa
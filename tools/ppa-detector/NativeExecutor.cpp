@@ -0,0 +1,18 @@
+#include "NativeExecutor.h"
+#include "llvm/Support/Program.h"
+
+using namespace llvm;
+
+namespace ppa {
+
+void NativeExecutor::Build(Module& m, StringRef name) {
+  compiler_.Compile(m, name);
+}
+
+int NativeExecutor::Run(StringRef name, StringRef inputPath,
+                        ArrayRef<StringRef> env) {
+  return sys::ExecuteAndWait(name, {name}, env,
+                             {inputPath, StringRef(), StringRef()});
+}
+
+} // namespace ppa
@@ -2,6 +2,7 @@
 #define PPADETECTOR_CONFIG_H
 
 #define RUNTIME_LIB "ppa-rt"
+#define RUNTIME_BITCODE "ppa-rt.bc"
 #cmakedefine CMAKE_TEMP_LIBRARY_PATH "@CMAKE_TEMP_LIBRARY_PATH@"
 
 #endif
@@ -1,16 +1,29 @@
+#include "llvm/ADT/SmallString.h"
 #include "llvm/IR/LLVMContext.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IRReader/IRReader.h"
 #include "llvm/Support/CommandLine.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/LineIterator.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
 #include "llvm/Support/PrettyStackTrace.h"
 #include "llvm/Support/Signals.h"
 #include "llvm/Support/SourceMgr.h"
 #include "llvm/Support/raw_ostream.h"
 
+#include "FileHash.h"
+#include "ForkServerExecutor.h"
 #include "InstHistComparator.h"
+#include "InstHistIndex.h"
+#include "JITExecutor.h"
+#include "NativeExecutor.h"
+#include "Parallel.h"
 #include "SEBBComparator.h"
 #include "AllFilesLoader.h"
 
+#include <algorithm>
+#include <cmath>
 #include <memory>
 
 using namespace llvm;
@@ -19,26 +32,16 @@ enum class AnalysisType { InstHist, SEBB };
 
 static cl::OptionCategory ppaDetectorCategory{"ppa-detector options"};
 
-static cl::opt<std::string> plaintiffPath{cl::Positional,
-                                          cl::desc{"<plaintiff>"},
-                                          cl::value_desc{"bitcode filename"},
-                                          cl::init(""),
-                                          cl::Required,
-                                          cl::cat{ppaDetectorCategory}};
-
-static cl::opt<std::string> suspiciousPath{cl::Positional,
-                                           cl::desc{"<suspicious>"},
-                                           cl::value_desc{"bitcode filename"},
-                                           cl::init(""),
-                                           cl::Required,
-                                           cl::cat{ppaDetectorCategory}};
-
-static cl::opt<std::string> testCasesPath{
-    cl::Positional,
-    cl::desc{"<test cases>"},
-    cl::value_desc{"path to the test cases"},
-    cl::init(""),
-    cl::Required,
+static cl::list<std::string> inputPaths{
+    cl::Positional, cl::desc{"<plaintiff> <suspicious> <test cases>"},
+    cl::ZeroOrMore, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<std::string> corpusPath{
+    "corpus",
+    cl::desc{"Compare every pair of bitcode files in a directory or listed in "
+             "a manifest (one path per line) and print a similarity matrix; "
+             "the only positional argument is then <test cases>"},
+    cl::value_desc{"directory or manifest"}, cl::init(""),
     cl::cat{ppaDetectorCategory}};
 
 static cl::opt<AnalysisType> analysisType{
@@ -51,6 +54,130 @@ static cl::opt<AnalysisType> analysisType{
                    "blocks")),
     cl::Required, cl::cat{ppaDetectorCategory}};
 
+static cl::opt<unsigned> numJobs{
+    "j", cl::desc{"Number of test case runs to execute in parallel, and of "
+                  "threads reading submissions and comparing each pair of "
+                  "programs (0: one per hardware thread)"},
+    cl::value_desc{"N"}, cl::init(0), cl::Prefix, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<unsigned> matrixLimit{
+    "sebb-matrix-limit",
+    cl::desc{"Largest SEBB matrix, in MiB, to build for a pair of programs"},
+    cl::value_desc{"MiB"}, cl::init(1024), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<std::string> sampling{
+    "sebb-sampling",
+    cl::desc{"Which executions of each basic block log their values: all, "
+             "cap:N, geometric or every:N[:warmup]"},
+    cl::value_desc{"policy"}, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<std::string> values{
+    "sebb-values",
+    cl::desc{"How basic block executions log their values: exact, or sketch "
+             "for a fixed-size sketch of the inputs and of the outputs"},
+    cl::value_desc{"mode"}, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<bool> jit{
+    "sebb-jit",
+    cl::desc{"Compile the instrumented programs in memory and run them in "
+             "forked children of the detector instead of linking executables"},
+    cl::cat{ppaDetectorCategory}};
+
+static cl::opt<bool> forkServer{
+    "sebb-fork-server",
+    cl::desc{"Start every instrumented program once, stopped before main, and "
+             "have it fork a child per test case"},
+    cl::cat{ppaDetectorCategory}};
+
+static cl::opt<unsigned> optLevel{
+    "sebb-opt-level",
+    cl::desc{"Optimization level (0-3) of the instrumented executables; above "
+             "0 the runtime is linked in as bitcode and its hooks inlined"},
+    cl::value_desc{"N"}, cl::init(0), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<bool> verifyOpt{
+    "sebb-verify-opt",
+    cl::desc{"Also build every instrumented program at -O0, and check that "
+             "both builds log the same traces on every test case"},
+    cl::cat{ppaDetectorCategory}};
+
+static cl::opt<std::string> cacheDir{
+    "cache-dir",
+    cl::desc{"Cache instrumented executables in this directory, which may be "
+             "shared by several detector processes"},
+    cl::value_desc{"directory"}, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<unsigned> cacheLimit{
+    "cache-size-limit",
+    cl::desc{"Size, in MiB, beyond which the least recently used cached "
+             "executables are evicted"},
+    cl::value_desc{"MiB"}, cl::init(1024), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<bool> hookReport{
+    "sebb-hook-report",
+    cl::desc{"Report how many logging hooks the instrumentation of every "
+             "program inserted and removed"},
+    cl::cat{ppaDetectorCategory}};
+
+static cl::opt<double> threshold{
+    "sebb-threshold",
+    cl::desc{"Only decide whether the similarity of each pair reaches this "
+             "ratio, and stop computing it once that is known; pairs are "
+             "then reported as a range (0: compute every similarity)"},
+    cl::value_desc{"0-1"}, cl::init(0), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<double> inputCutoff{
+    "sebb-input-cutoff",
+    cl::desc{"Share of the inputs of a basic block execution that an "
+             "execution of the other block must have for the two to match"},
+    cl::value_desc{"0-1"}, cl::init(1), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<double> outputCutoff{
+    "sebb-output-cutoff",
+    cl::desc{"Share of the outputs of a basic block execution that an "
+             "execution of the other block must have for the two to match"},
+    cl::value_desc{"0-1"}, cl::init(1), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<double> blockCutoff{
+    "sebb-block-cutoff",
+    cl::desc{"Share of the executions of two basic blocks that must match "
+             "for the blocks to be similar (below 1 for any cutoff, every "
+             "pair of blocks is compared)"},
+    cl::value_desc{"0-1"}, cl::init(1), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<bool> paths{
+    "sebb-paths",
+    cl::desc{"Trace the control flow on the last test case by Ball-Larus "
+             "paths instead of block by block, which takes far less room "
+             "for programs that loop"},
+    cl::cat{ppaDetectorCategory}};
+
+static cl::opt<std::string> traceStore{
+    "trace-store",
+    cl::desc{"Keep the decoded runs of every instrumented executable on every "
+             "test case in this directory, so that a program is not run on a "
+             "test case again"},
+    cl::value_desc{"directory"}, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<unsigned> top{
+    "top",
+    cl::desc{"In corpus mode with instruction histograms, list the N "
+             "submissions most similar to each one instead of the matrix"},
+    cl::value_desc{"N"}, cl::init(0), cl::cat{ppaDetectorCategory}};
+
+static cl::opt<std::string> instHistIndex{
+    "inst-hist-index",
+    cl::desc{"Keep the instruction histogram of every submission in this "
+             "file, so that a submission is parsed only once, and with --top "
+             "list the most similar submissions from the whole index"},
+    cl::value_desc{"file"}, cl::cat{ppaDetectorCategory}};
+
+static cl::opt<bool> valueReport{
+    "sebb-value-report",
+    cl::desc{"Compare with both exact and sketched values and report the "
+             "time taken and the difference in similarity"},
+    cl::cat{ppaDetectorCategory}};
+
 cl::list<std::string> libPaths{
     "L", cl::Prefix, cl::desc{"Specify a library search path"},
     cl::value_desc{"directory"}, cl::cat{ppaDetectorCategory}};
@@ -59,18 +186,302 @@ cl::list<std::string> libraries{
     "l", cl::Prefix, cl::desc{"Specify libraries to link against"},
     cl::value_desc{"library prefix"}, cl::cat{ppaDetectorCategory}};
 
-static void compareInstHist(Module& p, Module& s) {
-  auto comparator = std::make_unique<ppa::InstHistComparator>();
-  comparator->compareModules(p, s);
+static const char* kCorpusExePrefix = "/tmp/ppa_detector_corpus_";
+
+// A similarity, or the range it is known to be in.
+struct Similarity {
+  Similarity(double value = 1.0) : lower(value), upper(value) {}
+  Similarity(double lower, double upper) : lower(lower), upper(upper) {}
+
+  double lower;
+  double upper;
+};
+
+using SimilarityMatrix = std::vector<std::vector<Similarity>>;
+
+static std::unique_ptr<Module> loadModule(StringRef path, LLVMContext& context,
+                                          const char* argv0) {
+  SMDiagnostic err;
+  std::unique_ptr<Module> module = parseIRFile(path, err, context);
+  if (!module) {
+    errs() << "Error reading bitcode file: " << path << "\n";
+    err.print(argv0, errs());
+  }
+  return module;
+}
+
+static std::vector<std::string> collectCorpus(StringRef path) {
+  std::vector<std::string> files;
+
+  if (sys::fs::is_directory(path)) {
+    std::error_code ec;
+    for (sys::fs::directory_iterator it(path, ec), end; it != end && !ec;
+         it.increment(ec)) {
+      if (sys::path::extension(it->path()) == ".bc") {
+        files.push_back(it->path());
+      }
+    }
+    std::sort(files.begin(), files.end());
+    return files;
+  }
+
+  auto buffer = MemoryBuffer::getFile(path);
+  if (!buffer) {
+    errs() << "Error reading corpus manifest: " << path << "\n";
+    return files;
+  }
+  // Relative entries are relative to the manifest itself.
+  StringRef baseDir = sys::path::parent_path(path);
+  for (line_iterator line(**buffer, true, '#'); !line.is_at_eof(); ++line) {
+    StringRef entry = line->trim();
+    if (entry.empty()) {
+      continue;
+    }
+    SmallString<128> file(entry);
+    if (sys::path::is_relative(file)) {
+      file = baseDir;
+      sys::path::append(file, entry);
+    }
+    files.push_back(std::string(file.str()));
+  }
+  return files;
+}
+
+static void printSimilarityMatrix(ArrayRef<std::string> files,
+                                  const SimilarityMatrix& matrix) {
+  for (auto& file : files) {
+    outs() << "\t" << sys::path::stem(file);
+  }
+  outs() << "\n";
+  for (size_t i = 0; i < files.size(); i++) {
+    outs() << sys::path::stem(files[i]);
+    for (size_t j = 0; j < files.size(); j++) {
+      const Similarity& similarity = matrix[i][j];
+      outs() << "\t" << (int)(std::round(similarity.lower * 100));
+      if (similarity.upper != similarity.lower) {
+        outs() << "-" << (int)(std::round(similarity.upper * 100));
+      }
+      outs() << "%";
+    }
+    outs() << "\n";
+  }
+}
+
+// Lists the submissions whose histograms are closest to that of each one.
+static void printMostSimilar(ArrayRef<std::string> files,
+                             const ppa::InstHistBatch& batch) {
+  for (size_t i = 0; i < files.size(); i++) {
+    outs() << sys::path::stem(files[i]);
+    // Every submission is most similar to itself, so ask for one more.
+    size_t listed = 0;
+    for (auto [j, similarity] : batch.findMostSimilar(batch[i], top + 1)) {
+      if (j == i || listed == top) {
+        continue;
+      }
+      outs() << "\t" << sys::path::stem(files[j]) << " "
+             << (int)(std::round(similarity * 100)) << "%";
+      listed++;
+    }
+    outs() << "\n";
+  }
+}
+
+// Like printMostSimilar, with the submissions found in the whole index.
+static void printNearestInIndex(ArrayRef<std::string> files,
+                                ArrayRef<std::string> keys,
+                                const ppa::InstHistBatch& batch,
+                                const ppa::InstHistIndex& index) {
+  for (size_t i = 0; i < files.size(); i++) {
+    outs() << sys::path::stem(files[i]);
+    size_t listed = 0;
+    for (auto [j, similarity] : index.findNearest(batch[i], top + 1)) {
+      if (index.key(j) == keys[i] || listed == top) {
+        continue;
+      }
+      outs() << "\t" << index.name(j) << " "
+             << (int)(std::round(similarity * 100)) << "%";
+      listed++;
+    }
+    outs() << "\n";
+  }
+}
+
+static ppa::SEBBOptions getSEBBOptions() {
+  ppa::SEBBOptions options;
+  options.numJobs = numJobs;
+  options.matrixLimit = size_t(matrixLimit) << 20;
+  options.sampling = sampling;
+  options.values = values;
+  options.valueReport = valueReport;
+  options.cacheDir = cacheDir;
+  options.cacheLimit = uint64_t(cacheLimit) << 20;
+  options.traceStore = traceStore;
+  options.hookReport = hookReport;
+  options.paths = paths;
+  options.threshold = threshold;
+  options.inputCutoff = inputCutoff;
+  options.outputCutoff = outputCutoff;
+  options.blockCutoff = blockCutoff;
+  return options;
+}
+
+static std::unique_ptr<ppa::Executor> createExecutor() {
+  if (jit) {
+    return std::make_unique<ppa::JITExecutor>();
+  } else if (forkServer) {
+    return std::make_unique<ppa::ForkServerExecutor>(optLevel);
+  }
+  return std::make_unique<ppa::NativeExecutor>(optLevel);
+}
+
+// Only the opcodes matter, so neither module is loaded whole.
+static int compareInstHist(StringRef p, StringRef s) {
+  ppa::DenseInstHistogram histograms[2];
+  StringRef paths[2] = {p, s};
+  for (size_t i = 0; i < 2; i++) {
+    LLVMContext context;
+    auto histogram = ppa::computeHistogram(paths[i], context);
+    if (!histogram) {
+      errs() << "Error reading bitcode file: " << paths[i] << "\n"
+             << toString(histogram.takeError());
+      return -1;
+    }
+    histograms[i] = ppa::densifyHistogram(*histogram);
+  }
+  float score = ppa::compareDenseHistograms(histograms[0], histograms[1]);
+  outs() << (int)(std::round(score * 100)) << "%\n";
+  return 0;
 }
 
-static void compareSEBB(Module& p, Module& s) {
+static void compareSEBB(Module& p, Module& s, StringRef testCasesPath) {
   ppa::AllFilesLoader loader;
-  loader.Initialize(testCasesPath.getValue());
-  auto comparator = std::make_unique<ppa::SEBBComparator>(loader);
+  loader.Initialize(testCasesPath);
+  auto executor = createExecutor();
+  auto comparator = std::make_unique<ppa::SEBBComparator>(loader, *executor,
+                                                          getSEBBOptions());
+  ppa::NativeExecutor reference;
+  if (verifyOpt) {
+    comparator->setReferenceExecutor(reference);
+  }
   comparator->compareModules(p, s);
 }
 
+// In corpus mode every submission is parsed, analyzed and dropped exactly
+// once; only the resulting (small) per-submission summaries are kept around
+// for the N^2 pairwise scoring.
+static int compareCorpus(StringRef testCasesPath, const char* argv0) {
+  std::vector<std::string> files = collectCorpus(corpusPath);
+  std::vector<std::string> loaded;
+  SimilarityMatrix matrix;
+
+  if (analysisType == AnalysisType::InstHist) {
+    std::unique_ptr<ppa::InstHistIndex> index;
+    if (!instHistIndex.empty()) {
+      index = std::make_unique<ppa::InstHistIndex>(instHistIndex);
+    }
+    std::vector<std::string> keys(files.size());
+    std::vector<ppa::DenseInstHistogram> histograms(files.size());
+    // Whether each file was found in the index, read, or could not be read.
+    enum class Source : char { Index, File, Error };
+    std::vector<Source> sources(files.size(), Source::File);
+    std::vector<size_t> unindexed;
+    for (size_t i = 0; i < files.size(); i++) {
+      if (index) {
+        keys[i] = ppa::hashFile(files[i]);
+        if (auto* histogram = index->lookup(keys[i])) {
+          histograms[i] = *histogram;
+          sources[i] = Source::Index;
+          continue;
+        }
+      }
+      unindexed.push_back(i);
+    }
+
+    // Each submission gets a context of its own, so that nothing it loads
+    // outlives it and workers share nothing.
+    std::vector<std::string> errors(files.size());
+    ppa::parallelFor(numJobs, 0, unindexed.size(), [&](size_t k) {
+      size_t i = unindexed[k];
+      LLVMContext context;
+      auto histogram = ppa::computeHistogram(files[i], context);
+      if (!histogram) {
+        errors[i] = toString(histogram.takeError());
+        sources[i] = Source::Error;
+        return;
+      }
+      histograms[i] = ppa::densifyHistogram(*histogram);
+    });
+
+    ppa::InstHistBatch batch;
+    std::vector<std::string> loadedKeys;
+    for (size_t i = 0; i < files.size(); i++) {
+      if (sources[i] == Source::Error) {
+        errs() << "Error reading bitcode file: " << files[i] << "\n"
+               << errors[i];
+        continue;
+      }
+      if (index && sources[i] == Source::File) {
+        index->insert(keys[i], sys::path::stem(files[i]), histograms[i]);
+      }
+      batch.add(histograms[i]);
+      loaded.push_back(files[i]);
+      loadedKeys.push_back(keys[i]);
+    }
+
+    if (top) {
+      if (index) {
+        printNearestInIndex(loaded, loadedKeys, batch, *index);
+      } else {
+        printMostSimilar(loaded, batch);
+      }
+      return loaded.size() == files.size() ? 0 : -1;
+    }
+    std::vector<float> similarities = batch.computeMatrix(numJobs);
+    matrix.assign(loaded.size(), std::vector<Similarity>(loaded.size()));
+    for (size_t i = 0; i < loaded.size(); i++) {
+      for (size_t j = 0; j < loaded.size(); j++) {
+        matrix[i][j] = similarities[i * loaded.size() + j];
+      }
+    }
+  } else if (analysisType == AnalysisType::SEBB) {
+    ppa::AllFilesLoader loader;
+    loader.Initialize(testCasesPath);
+    auto executor = createExecutor();
+    auto comparator = std::make_unique<ppa::SEBBComparator>(
+        loader, *executor, getSEBBOptions());
+    ppa::NativeExecutor reference;
+    if (verifyOpt) {
+      comparator->setReferenceExecutor(reference);
+    }
+    std::vector<std::string> exePaths;
+    for (auto& file : files) {
+      LLVMContext context;
+      auto module = loadModule(file, context, argv0);
+      if (!module) {
+        continue;
+      }
+      exePaths.push_back(kCorpusExePrefix + std::to_string(loaded.size()));
+      comparator->buildModule(*module, exePaths.back());
+      loaded.push_back(file);
+    }
+    std::vector<ppa::SEBBProfile> profiles =
+        comparator->profileExecutables(exePaths);
+
+    matrix.assign(loaded.size(), std::vector<Similarity>(loaded.size()));
+    for (size_t i = 0; i < loaded.size(); i++) {
+      for (size_t j = i + 1; j < loaded.size(); j++) {
+        ppa::SEBBScore score =
+            comparator->compareProfiles(profiles[i], profiles[j]);
+        matrix[i][j] = matrix[j][i] =
+            Similarity(score.similarity(), score.maxSimilarity());
+      }
+    }
+  }
+
+  printSimilarityMatrix(loaded, matrix);
+  return loaded.size() == files.size() ? 0 : -1;
+}
+
 int main(int argc, char** argv) {
   // This boilerplate provides convenient stack traces and clean LLVM exit
   // handling. It also initializes the built in support for convenient
@@ -81,34 +492,68 @@ int main(int argc, char** argv) {
   cl::HideUnrelatedOptions(ppaDetectorCategory);
   cl::ParseCommandLineOptions(argc, argv);
 
+  if (jit && forkServer) {
+    errs() << "--sebb-jit and --sebb-fork-server cannot be combined.\n";
+    return -1;
+  }
+  if (optLevel > 3) {
+    errs() << "Invalid optimization level: " << optLevel << "\n";
+    return -1;
+  }
+  if (jit && optLevel > 0) {
+    errs() << "--sebb-opt-level only applies to native builds; the JIT "
+              "compiles at -O0.\n";
+    return -1;
+  }
+  if (threshold < 0 || threshold > 1) {
+    errs() << "Invalid similarity threshold: " << threshold << "\n";
+    return -1;
+  }
+  for (double cutoff : {inputCutoff.getValue(), outputCutoff.getValue(),
+                        blockCutoff.getValue()}) {
+    if (cutoff < 0 || cutoff > 1) {
+      errs() << "Invalid similarity cutoff: " << cutoff << "\n";
+      return -1;
+    }
+  }
+
+  if (!corpusPath.empty()) {
+    if (analysisType == AnalysisType::SEBB && inputPaths.size() != 1) {
+      errs() << "Usage: " << argv[0]
+             << " --sebb --corpus=<corpus> <test cases>\n";
+      return -1;
+    }
+    return compareCorpus(inputPaths.empty() ? "" : inputPaths[0], argv[0]);
+  }
+
+  if (inputPaths.size() != 3) {
+    errs() << "Usage: " << argv[0]
+           << " <plaintiff> <suspicious> <test cases>\n";
+    return -1;
+  }
+
+  if (analysisType == AnalysisType::InstHist) {
+    return compareInstHist(inputPaths[0], inputPaths[1]);
+  }
+
   // Construct an IR file from the filename passed on the command line.
-  SMDiagnostic err_p;
   LLVMContext context_p;
   std::unique_ptr<Module> plaintiffModule =
-      parseIRFile(plaintiffPath.getValue(), err_p, context_p);
-
+      loadModule(inputPaths[0], context_p, argv[0]);
   if (!plaintiffModule.get()) {
-    errs() << "Error reading bitcode file: " << plaintiffPath << "\n";
-    err_p.print(argv[0], errs());
     return -1;
   }
 
-  SMDiagnostic err_s;
   LLVMContext context_s;
   std::unique_ptr<Module> suspiciousModule =
-      parseIRFile(suspiciousPath.getValue(), err_s, context_s);
-
+      loadModule(inputPaths[1], context_s, argv[0]);
   if (!suspiciousModule.get()) {
-    errs() << "Error reading bitcode file: " << suspiciousPath << "\n";
-    err_s.print(argv[0], errs());
     return -1;
   }
 
-  if (analysisType == AnalysisType::InstHist) {
-    compareInstHist(*plaintiffModule, *suspiciousModule);
-  } else if (analysisType == AnalysisType::SEBB) {
-    compareSEBB(*plaintiffModule, *suspiciousModule);
+  if (analysisType == AnalysisType::SEBB) {
+    compareSEBB(*plaintiffModule, *suspiciousModule, inputPaths[2]);
   }
 
   return 0;
-}
\ No newline at end of file
+}